@@ -0,0 +1,117 @@
+#include <random>
+
+#include <QtCore>
+
+#include "benchmark.h"
+#include "imagemagic.h"
+#include "kernels.h"
+#include "poissonsolver.h"
+
+// Noisy texture with a small square hole in the middle, the same for every run
+// The whole image is searched, which is as large as the region filled around a hole with the
+// default source margin; FFT searches of this size already run in several tiles.
+static const int sceneSize = 576;
+
+static void makeScene(QImage &image, BitMatrix &mask) {
+    const int size = sceneSize, hole = 8;
+    image = QImage(size, size, QImage::Format_RGB32);
+    std::mt19937 random(1);
+    for (int y = 0; y < size; ++y) {
+        auto *line = reinterpret_cast<QRgb *>(image.scanLine(y));
+        for (int x = 0; x < size; ++x)
+            line[x] = qRgb((x * 5 + y * 3) % 256, (x / 12 + y / 12) % 2 * 160 + random() % 64,
+                           random() % 256);
+    }
+    mask = BitMatrix(size, size);
+    mask.fill1();
+    for (int y = (size - hole) / 2; y < (size + hole) / 2; ++y)
+        for (int x = (size - hole) / 2; x < (size + hole) / 2; ++x)
+            mask(x, y) = false;
+}
+
+static qint64 timeSmartFill(const ImageMagic::SmartFillOptions &options) {
+    QImage image;
+    BitMatrix mask(0, 0);
+    makeScene(image, mask);
+    QElapsedTimer timer;
+    timer.start();
+    ImageMagic::smartFill(image, mask, options);
+    return timer.nsecsElapsed();
+}
+
+int Benchmark::measureFftCrossover() {
+    QTextStream out(stdout);
+    out << "Smart fill, direct and FFT window comparison over " << sceneSize << 'x' << sceneSize
+        << " pixels (" << Kernels::table().isa << " kernels)\n";
+    out << "window\tdirect ms\tfft ms\n";
+    ImageMagic::SmartFillOptions options;
+    options.batchSize = 1;
+    int crossover = ImageMagic::SmartFillOptions::maxWindowSize + 1;
+    for (int windowSize = 7; windowSize <= 31; windowSize += 2) {
+        options.windowSize = windowSize;
+        options.fftCrossover = ImageMagic::SmartFillOptions::maxWindowSize + 1;
+        qint64 direct = timeSmartFill(options);
+        options.fftCrossover = windowSize;
+        qint64 fft = timeSmartFill(options);
+        out << windowSize << '\t' << direct / 1e6 << '\t' << fft / 1e6 << '\n';
+        out.flush();
+        if (fft >= direct) crossover = ImageMagic::SmartFillOptions::maxWindowSize + 1;
+        else if (crossover > windowSize) crossover = windowSize;
+    }
+    out << "FFT crossover: " << crossover << '\n';
+    out.flush();
+    QSettings settings(QCoreApplication::organizationName(), QCoreApplication::applicationName());
+    settings.setValue("smartFill/fftCrossover", crossover);
+    return crossover;
+}
+
+// Smooth image with a noisy square patch of `side` pixels fused into its middle
+static qint64 timePoissonFusion(int side, const QString &backend, PoissonSolver::Stats &stats) {
+    const int margin = 2, size = side + 2 * margin;
+    QImage original(size, size, QImage::Format_RGB32), image(size, size, QImage::Format_RGB32);
+    QImage mask(size, size, QImage::Format_Grayscale8);
+    std::mt19937 random(1);
+    mask.fill(0);
+    for (int y = 0; y < size; ++y) {
+        auto *originalLine = reinterpret_cast<QRgb *>(original.scanLine(y));
+        auto *line = reinterpret_cast<QRgb *>(image.scanLine(y));
+        for (int x = 0; x < size; ++x) {
+            originalLine[x] = qRgb(x * 255 / size, y * 255 / size, 128);
+            line[x] = qRgb(random() % 256, (x + y) % 256, 64 + random() % 128);
+        }
+        if (y >= margin && y < margin + side)
+            memset(mask.scanLine(y) + margin, 1, static_cast<size_t>(side));
+    }
+    QString selected = PoissonSolver::selectedBackend();
+    PoissonSolver::selectBackend(backend);
+    QElapsedTimer timer;
+    timer.start();
+    ImageMagic::poissonFusion(original, image, mask, &stats);
+    qint64 elapsed = timer.nsecsElapsed();
+    PoissonSolver::selectBackend(selected);
+    return elapsed;
+}
+
+int Benchmark::measureDirectMaxVars() {
+    QTextStream out(stdout);
+    out << "Poisson fusion, direct, iterative and reduced solvers\n";
+    out << "unknowns\tldlt ms\tldlt KB\tcg ms\tcg KB\tcg iterations\tquadtree ms\tquadtree KB\tquadtree unknowns\n";
+    int directMaxVars = 0;
+    for (int side : {64, 128, 256, 384, 512, 768, 1024}) {
+        PoissonSolver::Stats direct, iterative, reduced;
+        qint64 directTime = timePoissonFusion(side, "ldlt", direct);
+        qint64 iterativeTime = timePoissonFusion(side, "cg", iterative);
+        qint64 reducedTime = timePoissonFusion(side, "quadtree", reduced);
+        out << side * side << '\t' << directTime / 1e6 << '\t' << direct.memory / 1024 << '\t'
+            << iterativeTime / 1e6 << '\t' << iterative.memory / 1024 << '\t' << iterative.iterations << '\t'
+            << reducedTime / 1e6 << '\t' << reduced.memory / 1024 << '\t' << reduced.unknowns << '\n';
+        out.flush();
+        if (directTime <= iterativeTime) directMaxVars = side * side;
+    }
+    out << "Direct solver up to: " << directMaxVars << " unknowns\n";
+    out.flush();
+    QSettings settings(QCoreApplication::organizationName(), QCoreApplication::applicationName());
+    settings.setValue("solver/directMaxVars", directMaxVars);
+    PoissonSolver::setDirectMaxVars(directMaxVars);
+    return directMaxVars;
+}
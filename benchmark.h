@@ -0,0 +1,20 @@
+#ifndef POISSONEDITOR_BENCHMARK_H
+#define POISSONEDITOR_BENCHMARK_H
+
+
+// Measurements behind the tunable defaults, run with --benchmark
+namespace Benchmark {
+
+    // Time smart fill with windows compared directly and by FFT for each window size, searching
+    // an area as large as the editor's, print the timings and store the smallest size from which
+    // the FFT stays faster as smartFill/fftCrossover
+    int measureFftCrossover();
+
+    // Time Poisson fusion of growing square patches with the direct, iterative and quadtree
+    // solvers, print the timings and store the largest patch the direct solver is faster on, in unknowns,
+    // as solver/directMaxVars
+    int measureDirectMaxVars();
+
+}
+
+#endif //POISSONEDITOR_BENCHMARK_H
@@ -1,4 +1,5 @@
 #include "bitmatrix.h"
+#include "kernels.h"
 
 BitMatrix::BitMatrix(const utils::Matrix<bool> &mat)
         : utils::Matrix<uchar>((mat.n + bitMask) >> logBits, mat.m), n_bits(mat.n), m_bits(mat.m) {
@@ -36,47 +37,83 @@ void BitMatrix::invert() {
 //        arr[y * n + n - 1] &= bitMaskEOL;
 }
 
+enum class BitOp {
+    And, Or, AndNot
+};
+
+// Combine the first `count` bits of `src` into `dst`, starting at bit `shift` (< 8) of dst[0]
+// Bits of `dst` outside the range are left untouched and padding bits of `src` are ignored.
+// Fully covered bytes are handled by the kernels, partially covered ones at both ends here.
+static void combineRow(uchar *dst, const uchar *src, int count, int shift, BitOp op) {
+    if (count <= 0) return;
+    const int srcBytes = (count + 7) >> 3, dstBytes = (shift + count + 7) >> 3;
+    auto combineByte = [&](int j) {
+        int lo = j < srcBytes ? src[j] << shift : 0;
+        int hi = j > 0 ? src[j - 1] >> (8 - shift) : 0;
+        int first = qMax(shift - 8 * j, 0), last = qMin(shift + count - 8 * j, 8);
+        auto range = static_cast<uchar>((1 << last) - (1 << first));
+        auto val = static_cast<uchar>((lo | hi) & range);
+        switch (op) {
+            case BitOp::And:
+                dst[j] &= static_cast<uchar>(val | ~range);
+                break;
+            case BitOp::Or:
+                dst[j] |= val;
+                break;
+            case BitOp::AndNot:
+                dst[j] &= static_cast<uchar>(~val);
+                break;
+        }
+    };
+
+    combineByte(0);
+    if (dstBytes > 2) {
+        const Kernels::Table &kernels = Kernels::table();
+        auto kernel = op == BitOp::And ? kernels.bitsAnd : op == BitOp::Or ? kernels.bitsOr : kernels.bitsAndNot;
+        kernel(dst, src, 1, dstBytes - 1, shift);
+    }
+    if (dstBytes > 1) combineByte(dstBytes - 1);
+}
+
 void BitMatrix::subMatrixAnd(const BitMatrix &mat, int offsetX, int offsetY) {
     assert(mat.m_bits + offsetY <= m_bits && mat.n_bits + offsetX <= n_bits);
     assert(offsetX >= 0 && offsetY >= 0);
     int blocks = offsetX >> logBits, bits = offsetX & bitMask;
-    if (bits == 0) {
-        for (int y = 0; y < mat.m_bits; ++y) {
-            int st = (y + offsetY) * n + blocks, matSt = y * mat.n;
-            for (int x = 0; x < mat.n; ++x)
-                arr[st + x] &= mat.arr[matSt + x];
-        }
-    } else {
-        auto fullMask = static_cast<uchar>((1 << (bitMask + 1)) - 1);
-        uchar maskLo = ~(fullMask << bits);
-        uchar maskHi = ~(fullMask >> (bitMask + 1 - bits));
-        for (int y = 0; y < mat.m_bits; ++y) {
-            int st = (y + offsetY) * n + blocks, matSt = y * mat.n;
-            for (int x = 0; x < mat.n; ++x) {
-                arr[st + x] &= maskLo | (mat.arr[matSt + x] << bits);
-                arr[st + x + 1] &= maskHi | (mat.arr[matSt + x] >> (bitMask + 1 - bits));
-            }
-        }
-    }
+    for (int y = 0; y < mat.m_bits; ++y)
+        combineRow(arr + (y + offsetY) * n + blocks, mat.arr + y * mat.n, mat.n_bits, bits, BitOp::And);
 }
 
 void BitMatrix::subMatrixOr(const BitMatrix &mat, int offsetX, int offsetY) {
     assert(mat.m_bits + offsetY <= m_bits && mat.n_bits + offsetX <= n_bits);
     assert(offsetX >= 0 && offsetY >= 0);
     int blocks = offsetX >> logBits, bits = offsetX & bitMask;
-    if (bits == 0) {
-        for (int y = 0; y < mat.m_bits; ++y) {
-            int st = (y + offsetY) * n + blocks, matSt = y * mat.n;
-            for (int x = 0; x < mat.n; ++x)
-                arr[st + x] |= mat.arr[matSt + x];
-        }
-    } else {
-        for (int y = 0; y < mat.m_bits; ++y) {
-            int st = (y + offsetY) * n + blocks, matSt = y * mat.n;
-            for (int x = 0; x < mat.n; ++x) {
-                arr[st + x] |= mat.arr[matSt + x] << bits;
-                arr[st + x + 1] |= mat.arr[matSt + x] >> (bitMask + 1 - bits);
-            }
+    for (int y = 0; y < mat.m_bits; ++y)
+        combineRow(arr + (y + offsetY) * n + blocks, mat.arr + y * mat.n, mat.n_bits, bits, BitOp::Or);
+}
+
+void BitMatrix::subMatrixAndNot(const BitMatrix &mat, int offsetX, int offsetY) {
+    assert(mat.m_bits + offsetY <= m_bits && mat.n_bits + offsetX <= n_bits);
+    assert(offsetX >= 0 && offsetY >= 0);
+    int blocks = offsetX >> logBits, bits = offsetX & bitMask;
+    for (int y = 0; y < mat.m_bits; ++y)
+        combineRow(arr + (y + offsetY) * n + blocks, mat.arr + y * mat.n, mat.n_bits, bits, BitOp::AndNot);
+}
+
+BitMatrix BitMatrix::subMatrix(int offsetX, int offsetY, int n, int m) const {
+    assert(offsetX >= 0 && offsetY >= 0 && offsetX + n <= n_bits && offsetY + m <= m_bits);
+    BitMatrix ret(n, m);
+    for (int y = 0; y < m; ++y)
+        for (int x = 0; x < n; ++x)
+            if (get(offsetX + x, offsetY + y)) ret.set1(x, y);
+    return ret;
+}
+
+void BitMatrix::setSubMatrix(const BitMatrix &mat, int offsetX, int offsetY) {
+    assert(mat.m_bits + offsetY <= m_bits && mat.n_bits + offsetX <= n_bits);
+    assert(offsetX >= 0 && offsetY >= 0);
+    for (int y = 0; y < mat.m_bits; ++y)
+        for (int x = 0; x < mat.n_bits; ++x) {
+            if (mat.get(x, y)) set1(offsetX + x, offsetY + y);
+            else set0(offsetX + x, offsetY + y);
         }
-    }
 }
@@ -72,11 +72,20 @@ public:
         return arr;
     }
 
+    inline uchar *toBytes() {
+        return arr;
+    }
+
+    BitMatrix subMatrix(int offsetX, int offsetY, int n, int m) const;
+    void setSubMatrix(const BitMatrix &mat, int offsetX, int offsetY);
+
     void fill1();
     void invert();
 
     void subMatrixAnd(const BitMatrix &mat, int offsetX, int offsetY);
     void subMatrixOr(const BitMatrix &mat, int offsetX, int offsetY);
+    // Clear the bits set in `mat`, same as inverting `mat` and calling subMatrixAnd
+    void subMatrixAndNot(const BitMatrix &mat, int offsetX, int offsetY);
 };
 
 
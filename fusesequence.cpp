@@ -0,0 +1,85 @@
+#include <deque>
+#include <utility>
+#include <vector>
+
+#include <QtCore>
+#include <QtConcurrent>
+
+#include "fusesequence.h"
+#include "imagemagic.h"
+
+static bool readOffsets(const QString &path, std::vector<QPoint> &offsets) {
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) return false;
+    QTextStream in(&file);
+    while (!in.atEnd()) {
+        auto fields = in.readLine().split(' ', QString::SkipEmptyParts);
+        if (fields.isEmpty()) continue;
+        bool okX = false, okY = false;
+        QPoint offset(fields[0].toInt(&okX), fields.size() > 1 ? fields[1].toInt(&okY) : 0);
+        if (!okX || !okY) return false;
+        offsets.push_back(offset);
+    }
+    return true;
+}
+
+int FuseSequence::run(const QString &patchPath, const QStringList &framePaths, const QString &offsetsPath,
+                      const QString &outputDirectory) {
+    QTextStream err(stderr);
+    QImage patch(patchPath);
+    if (patch.isNull()) {
+        err << "Cannot read patch " << patchPath << '\n';
+        return 1;
+    }
+    std::vector<QPoint> offsets;
+    if (!offsetsPath.isEmpty() && !readOffsets(offsetsPath, offsets)) {
+        err << "Cannot read offsets from " << offsetsPath << '\n';
+        return 1;
+    }
+    QDir output(outputDirectory);
+    if (!output.mkpath(".")) {
+        err << "Cannot create " << outputDirectory << '\n';
+        return 1;
+    }
+
+    ImageMagic::SequenceFusion fusion(patch);
+    // Frames in flight on either side of the solve, which bounds the memory held by the pipeline
+    const int lookahead = qMax(QThread::idealThreadCount() - 1, 1);
+    std::deque<QFuture<QImage>> decoded;
+    std::deque<std::pair<QString, QFuture<bool>>> encoded;
+    int exitCode = 0;
+    auto finishEncode = [&]() {
+        if (!encoded.front().second.result()) {
+            err << "Cannot write " << encoded.front().first << '\n';
+            exitCode = 1;
+        }
+        encoded.pop_front();
+    };
+
+    QElapsedTimer timer;
+    timer.start();
+    int next = 0;
+    for (int i = 0; i < framePaths.size(); ++i) {
+        for (; next < framePaths.size() && next <= i + lookahead; ++next) {
+            QString path = framePaths[next];
+            decoded.push_back(QtConcurrent::run([path]() { return QImage(path); }));
+        }
+        QImage frame = decoded.front().result();
+        decoded.pop_front();
+        if (frame.isNull()) {
+            err << "Cannot read frame " << framePaths[i] << '\n';
+            exitCode = 1;
+            continue;
+        }
+
+        QPoint offset = offsets.empty() ? QPoint() : offsets[qMin<size_t>(i, offsets.size() - 1)];
+        QImage fused = fusion.fuse(frame, offset);
+
+        QString path = output.filePath(QFileInfo(framePaths[i]).fileName());
+        encoded.emplace_back(path, QtConcurrent::run([fused, path]() { return fused.save(path); }));
+        if (encoded.size() > static_cast<size_t>(lookahead)) finishEncode();
+    }
+    while (!encoded.empty()) finishEncode();
+    qDebug() << "FuseSequence::run :" << framePaths.size() << "frames in" << timer.elapsed() << "ms";
+    return exitCode;
+}
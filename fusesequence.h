@@ -0,0 +1,21 @@
+#ifndef POISSONEDITOR_FUSESEQUENCE_H
+#define POISSONEDITOR_FUSESEQUENCE_H
+
+#include <QString>
+#include <QStringList>
+
+
+// Fusion of one patch into a sequence of frames, run with --fuse-sequence
+namespace FuseSequence {
+
+    // Fuse the patch into each frame and save the result under the same file name in
+    // `outputDirectory`. Line i of `offsetsPath` holds the offset "x y" of the patch in frame i,
+    // frames past the last line keep the last offset; without the file the offset is 0 0.
+    // Frames are decoded ahead and encoded behind the one being fused, on other threads.
+    // Returns the exit code.
+    int run(const QString &patchPath, const QStringList &framePaths, const QString &offsetsPath,
+            const QString &outputDirectory);
+
+}
+
+#endif //POISSONEDITOR_FUSESEQUENCE_H
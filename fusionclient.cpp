@@ -0,0 +1,57 @@
+#include <QtCore>
+#include <QLocalSocket>
+
+
+// Command line client of the server started with --server, for testing
+// Sends the jobs given as arguments, or read from standard input one per line, and prints the
+// answers as they arrive. Exits with 1 if any job failed.
+int main(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("Poisson Image Editing Client");
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Send fusion and fill jobs to a Poisson Image Editing server.");
+    parser.addHelpOption();
+    parser.addPositionalArgument("jobs", "Jobs as JSON objects, read from standard input if none are given.");
+    parser.addOption({"socket", "Name of the local socket of the server.", "name", "poisson-editor"});
+    parser.process(app);
+
+    QTextStream out(stdout), err(stderr);
+    QStringList jobs = parser.positionalArguments();
+    if (jobs.isEmpty()) {
+        QTextStream in(stdin);
+        while (!in.atEnd()) {
+            QString line = in.readLine().trimmed();
+            if (!line.isEmpty()) jobs.append(line);
+        }
+    }
+
+    QLocalSocket socket;
+    socket.connectToServer(parser.value("socket"));
+    if (!socket.waitForConnected(5000)) {
+        err << "Cannot connect to " << parser.value("socket") << ": " << socket.errorString() << '\n';
+        return 1;
+    }
+    // The server reads a job per line
+    for (const auto &job : jobs) {
+        QJsonDocument document = QJsonDocument::fromJson(job.toUtf8());
+        socket.write(document.isObject() ? document.toJson(QJsonDocument::Compact) : job.simplified().toUtf8());
+        socket.write("\n");
+    }
+    socket.flush();
+
+    int answered = 0, failed = 0;
+    while (answered < jobs.size()) {
+        if (!socket.canReadLine() && !socket.waitForReadyRead(-1)) {
+            err << "Connection lost: " << socket.errorString() << '\n';
+            return 1;
+        }
+        while (socket.canReadLine()) {
+            QByteArray line = socket.readLine();
+            out << line;
+            out.flush();
+            ++answered;
+            if (!QJsonDocument::fromJson(line).object()["ok"].toBool()) ++failed;
+        }
+    }
+    return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,162 @@
+#include <QtConcurrent>
+
+#include "fusionserver.h"
+#include "poissonsolver.h"
+
+
+// Fusion of one patch file, shared by the jobs using it; jobs on the same patch run one at a
+// time so that each can start from the solution of the previous one
+struct FusionServer::Patch {
+    QMutex mutex;
+    ImageMagic::SequenceFusion fusion;
+
+    explicit Patch(const QImage &image) : fusion(image) {}
+};
+
+FusionServer::FusionServer(QObject *parent) : QObject(parent) {
+    QSettings settings(QCoreApplication::organizationName(), QCoreApplication::applicationName());
+    decoded.setMaxCost(settings.value("server/decodeCacheMB", 256).toInt() * 1024);
+    fillOptions = ImageMagic::SmartFillOptions::fromSettings();
+    connect(&server, &QLocalServer::newConnection, this, &FusionServer::acceptConnection);
+}
+
+FusionServer::~FusionServer() {
+    server.close();
+    pool.waitForDone();
+}
+
+bool FusionServer::listen(const QString &name) {
+    // A server that crashed leaves its socket file behind, but one that answers is still running
+    // and must not be taken over
+    QLocalSocket probe;
+    probe.connectToServer(name);
+    if (probe.waitForConnected(1000)) {
+        probe.disconnectFromServer();
+        error = "Another server is running";
+        return false;
+    }
+    QLocalServer::removeServer(name);
+    error.clear();
+    return server.listen(name);
+}
+
+QString FusionServer::errorString() const {
+    return error.isEmpty() ? server.errorString() : error;
+}
+
+void FusionServer::acceptConnection() {
+    while (QLocalSocket *socket = server.nextPendingConnection()) {
+        connect(socket, &QLocalSocket::disconnected, socket, &QObject::deleteLater);
+        connect(socket, &QLocalSocket::readyRead, this, [this, socket]() { readJobs(socket); });
+    }
+}
+
+void FusionServer::readJobs(QLocalSocket *socket) {
+    QPointer<QLocalSocket> connection(socket);
+    auto reply = [connection](const QJsonObject &response) {
+        if (connection.isNull()) return;
+        connection->write(QJsonDocument(response).toJson(QJsonDocument::Compact) + '\n');
+        connection->flush();
+    };
+    while (socket->canReadLine()) {
+        QByteArray line = socket->readLine().trimmed();
+        if (line.isEmpty()) continue;
+        QJsonParseError error;
+        QJsonDocument document = QJsonDocument::fromJson(line, &error);
+        if (!document.isObject()) {
+            reply(QJsonObject{{"ok", false}, {"error", "Invalid job: " + error.errorString()}});
+            continue;
+        }
+        QJsonObject job = document.object();
+        auto *watcher = new QFutureWatcher<QJsonObject>(this);
+        connect(watcher, &QFutureWatcher<QJsonObject>::finished, this, [watcher, reply]() {
+            reply(watcher->result());
+            watcher->deleteLater();
+        });
+        watcher->setFuture(QtConcurrent::run(&pool, [this, job]() { return run(job); }));
+    }
+}
+
+QJsonObject FusionServer::run(const QJsonObject &job) {
+    QElapsedTimer timer;
+    timer.start();
+    QJsonObject response;
+    if (job.contains("id")) response["id"] = job["id"];
+    auto fail = [&response](const QString &error) {
+        response["ok"] = false;
+        response["error"] = error;
+        return response;
+    };
+
+    QString op = job["op"].toString(), output = job["output"].toString();
+    if (output.isEmpty()) return fail("No output path");
+    QImage image = load(job["image"].toString());
+    if (image.isNull()) return fail("Cannot read image " + job["image"].toString());
+
+    if (op == "fuse") {
+        auto entry = patch(job["patch"].toString());
+        if (entry == nullptr) return fail("Cannot read patch " + job["patch"].toString());
+        PoissonSolver::Stats stats;
+        {
+            QMutexLocker locker(&entry->mutex);
+            image = entry->fusion.fuse(image, QPoint(job["x"].toInt(), job["y"].toInt()), &stats);
+        }
+        response["backend"] = stats.backend;
+        response["unknowns"] = stats.unknowns;
+        response["iterations"] = stats.iterations;
+        response["residual"] = stats.residual;
+        response["memory"] = static_cast<double>(stats.memory);
+    } else if (op == "fill") {
+        QImage mask = load(job["mask"].toString());
+        if (mask.isNull()) return fail("Cannot read mask " + job["mask"].toString());
+        if (mask.size() != image.size()) return fail("Mask and image sizes differ");
+        mask = mask.convertToFormat(QImage::Format_Grayscale8);
+        BitMatrix known(image.width(), image.height());
+        known.fill1();
+        for (int y = 0; y < mask.height(); ++y) {
+            const uchar *line = mask.constScanLine(y);
+            for (int x = 0; x < mask.width(); ++x)
+                if (line[x] >= 128) known(x, y) = false;
+        }
+        ImageMagic::smartFill(image, known, fillOptions);
+    } else {
+        return fail("Unknown op " + op);
+    }
+
+    if (!image.save(output)) return fail("Cannot write " + output);
+    response["ok"] = true;
+    response["ms"] = static_cast<double>(timer.elapsed());
+    return response;
+}
+
+QImage FusionServer::load(const QString &path) {
+    QFileInfo info(path);
+    if (!info.exists()) return QImage();
+    QString key = info.absoluteFilePath() + '@' + QString::number(info.lastModified().toMSecsSinceEpoch());
+    {
+        QMutexLocker locker(&cacheMutex);
+        if (QImage *cached = decoded.object(key)) return *cached;
+    }
+    QImage image(path);
+    if (image.isNull()) return image;
+    QMutexLocker locker(&cacheMutex);
+    decoded.insert(key, new QImage(image), image.bytesPerLine() * image.height() / 1024);
+    return image;
+}
+
+std::shared_ptr<FusionServer::Patch> FusionServer::patch(const QString &path) {
+    QImage image = load(path);
+    if (image.isNull()) return nullptr;
+    QFileInfo info(path);
+    QString key = info.absoluteFilePath() + '@' + QString::number(info.lastModified().toMSecsSinceEpoch());
+    QMutexLocker locker(&cacheMutex);
+    auto it = patches.find(key);
+    if (it != patches.end()) return it->second;
+    // Patches no job is using are dropped once there are many
+    const size_t maxPatches = 16;
+    for (auto unused = patches.begin(); unused != patches.end() && patches.size() >= maxPatches;)
+        unused = unused->second.use_count() == 1 ? patches.erase(unused) : std::next(unused);
+    auto entry = std::make_shared<Patch>(image);
+    patches.emplace(key, entry);
+    return entry;
+}
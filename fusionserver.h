@@ -0,0 +1,59 @@
+#ifndef POISSONEDITOR_FUSIONSERVER_H
+#define POISSONEDITOR_FUSIONSERVER_H
+
+#include <map>
+#include <memory>
+
+#include <QtCore>
+#include <QImage>
+#include <QLocalServer>
+#include <QLocalSocket>
+
+#include "imagemagic.h"
+
+
+// Long-lived server for fusion and fill jobs, run with --server
+// Clients connect to a local socket and send one JSON object per line:
+//   {"id": 1, "op": "fuse", "image": path, "patch": path, "x": 10, "y": 20, "output": path}
+//   {"id": 2, "op": "fill", "image": path, "mask": path, "output": path}
+// A fuse job places the pixels of the patch with nonzero alpha at (x, y) of the image; a fill
+// job fills the pixels that are white in the mask. Each job is answered by one line with the
+// same id, "ok" and either "error" or the time taken and, for fusions, the solver stats.
+// Jobs run on a pool of their own and may finish out of order. Decoded images and the
+// factorized systems of patches are kept between jobs, so that repeated jobs on the same
+// files skip decoding and factorization.
+class FusionServer : public QObject {
+Q_OBJECT
+
+public:
+    explicit FusionServer(QObject *parent = nullptr);
+    ~FusionServer() override;
+    FusionServer(const FusionServer &) = delete;
+    FusionServer &operator =(const FusionServer &) = delete;
+
+    bool listen(const QString &name);
+    QString errorString() const;
+
+private slots:
+    void acceptConnection();
+
+private:
+    struct Patch;
+
+    void readJobs(QLocalSocket *socket);
+    QJsonObject run(const QJsonObject &job);
+    QImage load(const QString &path);
+    std::shared_ptr<Patch> patch(const QString &path);
+
+    QLocalServer server;
+    QString error; // set when another server already listens on the name
+    QThreadPool pool;
+    ImageMagic::SmartFillOptions fillOptions;
+
+    QMutex cacheMutex;
+    QCache<QString, QImage> decoded; // keyed by path and modification time, cost in KB
+    std::map<QString, std::shared_ptr<Patch>> patches;
+};
+
+
+#endif //POISSONEDITOR_FUSIONSERVER_H
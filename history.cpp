@@ -0,0 +1,191 @@
+#include <set>
+
+#include "history.h"
+#include "utils.h"
+
+History::History(qint64 memoryBudget, int maxSteps) : memoryBudget(memoryBudget), maxSteps(maxSteps) {}
+
+void History::setMemoryBudget(qint64 bytes) {
+    memoryBudget = bytes;
+    enforceLimits();
+}
+
+void History::setMaxSteps(int steps) {
+    maxSteps = steps;
+    enforceLimits();
+}
+
+void History::record(const ImageBuffer &buffer, const QRegion &region, bool alphaOnly) {
+    // Recording a new step discards everything that could be redone
+    while (static_cast<int>(steps.size()) > current)
+        dropBack();
+
+    std::set<std::pair<int, int>> tiles;
+    for (const QRect &rect : region.intersected(buffer.rect()).rects()) {
+        for (int ty = rect.top() / tileSize; ty <= rect.bottom() / tileSize; ++ty)
+            for (int tx = rect.left() / tileSize; tx <= rect.right() / tileSize; ++tx)
+                tiles.emplace(ty, tx);
+    }
+
+    Step step;
+    step.region = region.intersected(buffer.rect());
+    for (auto &t : tiles) {
+        QRect rect = QRect(t.second * tileSize, t.first * tileSize, tileSize, tileSize).intersected(buffer.rect());
+        step.tiles.push_back(Tile{rect, alphaOnly ? QImage() : buffer.copy(rect), buffer.copyAlpha(rect)});
+        step.bytes += tileBytes(step.tiles.back());
+    }
+    memoryInUse += step.bytes;
+    steps.push_back(std::move(step));
+    ++current;
+    enforceLimits();
+}
+
+bool History::canUndo() const {
+    return current > 0;
+}
+
+bool History::canRedo() const {
+    return current < static_cast<int>(steps.size());
+}
+
+QRegion History::undo(ImageBuffer &buffer) {
+    if (!canUndo()) return QRegion();
+    Step &step = steps[current - 1];
+    if (!restore(step)) {
+        qWarning() << "History::undo : cannot read spilled step, clearing history.";
+        clear();
+        return QRegion();
+    }
+    swapTiles(step, buffer);
+    --current;
+    QRegion region = step.region;
+    enforceLimits();
+    return region;
+}
+
+QRegion History::redo(ImageBuffer &buffer) {
+    if (!canRedo()) return QRegion();
+    Step &step = steps[current];
+    if (!restore(step)) {
+        qWarning() << "History::redo : cannot read spilled step, clearing history.";
+        clear();
+        return QRegion();
+    }
+    swapTiles(step, buffer);
+    ++current;
+    QRegion region = step.region;
+    enforceLimits();
+    return region;
+}
+
+void History::clear() {
+    steps.clear();
+    current = 0;
+    memoryInUse = 0;
+}
+
+void History::swapTiles(Step &step, ImageBuffer &buffer) {
+    for (auto &tile : step.tiles) {
+        const QRect &rect = tile.rect;
+        if (!tile.pixels.isNull()) {
+            QImage pixels = buffer.copy(rect);
+            buffer.write(rect.topLeft(), tile.pixels);
+            tile.pixels = pixels;
+        }
+        BitMatrix tileAlpha = buffer.copyAlpha(rect);
+        buffer.writeAlpha(rect, tile.alpha);
+        tile.alpha = std::move(tileAlpha);
+    }
+}
+
+qint64 History::tileBytes(const Tile &tile) {
+    return static_cast<qint64>(tile.pixels.bytesPerLine()) * tile.pixels.height()
+           + static_cast<qint64>(tile.alpha.rows()) * tile.alpha.cols();
+}
+
+bool History::spill(Step &step) {
+    std::unique_ptr<QTemporaryFile> file(new QTemporaryFile(QDir(QDir::tempPath()).filePath("poisson-editor-history-XXXXXX")));
+    if (!file->open()) return false;
+    QDataStream out(file.get());
+    out << static_cast<quint32>(step.tiles.size());
+    for (auto &tile : step.tiles) {
+        const QImage &pixels = tile.pixels;
+        out << tile.rect << static_cast<qint32>(pixels.isNull() ? QImage::Format_Invalid : pixels.format());
+        int lineBytes = pixels.width() * pixels.depth() / 8;
+        for (int y = 0; y < pixels.height(); ++y)
+            out.writeRawData(reinterpret_cast<const char *>(pixels.constScanLine(y)), lineBytes);
+        out.writeRawData(reinterpret_cast<const char *>(tile.alpha.toBytes()), tile.alpha.rows() * tile.alpha.cols());
+    }
+    if (out.status() != QDataStream::Ok || !file->flush()) return false;
+
+    memoryInUse -= step.bytes;
+    step.tiles.clear();
+    step.spillFile = std::move(file);
+    return true;
+}
+
+bool History::restore(Step &step) {
+    if (!step.spillFile) return true;
+    QTemporaryFile &file = *step.spillFile;
+    if (!file.seek(0)) return false;
+    QDataStream in(&file);
+    quint32 count;
+    in >> count;
+    std::vector<Tile> tiles;
+    for (quint32 i = 0; i < count; ++i) {
+        QRect rect;
+        qint32 format;
+        in >> rect >> format;
+        if (in.status() != QDataStream::Ok || rect.isEmpty()) return false;
+        QImage pixels;
+        if (format != QImage::Format_Invalid) {
+            pixels = QImage(rect.size(), static_cast<QImage::Format>(format));
+            int lineBytes = pixels.width() * pixels.depth() / 8;
+            for (int y = 0; y < pixels.height(); ++y)
+                in.readRawData(reinterpret_cast<char *>(pixels.scanLine(y)), lineBytes);
+        }
+        BitMatrix alpha(rect.width(), rect.height());
+        in.readRawData(reinterpret_cast<char *>(alpha.toBytes()), alpha.rows() * alpha.cols());
+        tiles.push_back(Tile{rect, pixels, std::move(alpha)});
+    }
+    if (in.status() != QDataStream::Ok) return false;
+
+    step.tiles = std::move(tiles);
+    step.spillFile.reset();
+    memoryInUse += step.bytes;
+    return true;
+}
+
+void History::dropFront() {
+    if (!steps.front().spillFile) memoryInUse -= steps.front().bytes;
+    steps.pop_front();
+    --current;
+}
+
+void History::dropBack() {
+    if (!steps.back().spillFile) memoryInUse -= steps.back().bytes;
+    steps.pop_back();
+}
+
+void History::enforceLimits() {
+    while (static_cast<int>(steps.size()) > maxSteps) {
+        if (current > 0) dropFront();
+        else dropBack();
+    }
+
+    // Spill the steps farthest from the current state first, whether they undo or redo, keeping
+    // the ones next to it in memory
+    auto distance = [this](int i) { return i < current ? current - 1 - i : i - current; };
+    while (memoryInUse > memoryBudget) {
+        int farthest = -1;
+        for (int i = 0; i < static_cast<int>(steps.size()); ++i) {
+            if (i == current - 1 || i == current || steps[i].spillFile) continue;
+            if (farthest < 0 || distance(i) > distance(farthest)) farthest = i;
+        }
+        if (farthest < 0) break;
+        if (spill(steps[farthest])) continue;
+        // No disk space for spilling, discard the steps at that end of the history instead
+        if (farthest < current) dropFront();
+        else dropBack();
+    }
+}
@@ -0,0 +1,71 @@
+#ifndef POISSONEDITOR_HISTORY_H
+#define POISSONEDITOR_HISTORY_H
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include <QtCore>
+#include <QtGui>
+
+#include "imagebuffer.h"
+
+
+// Undo/redo history of edits on an image buffer
+// A step only keeps the tiles touched by its edit. Undoing or redoing swaps them with
+// the tiles currently in the image, so both take time proportional to the edit.
+// When the kept tiles of undo and redo steps exceed the memory budget, the steps farthest
+// from the current state are spilled to temporary files; steps beyond the step limit are
+// discarded.
+class History {
+public:
+    explicit History(qint64 memoryBudget = 256ll << 20, int maxSteps = 100);
+    History(const History &) = delete;
+    History &operator =(const History &) = delete;
+
+    void setMemoryBudget(qint64 bytes);
+    void setMaxSteps(int steps);
+
+    // Must be called before the image is modified inside `region`
+    // Pixels are not kept if only the alpha mask is going to change
+    void record(const ImageBuffer &buffer, const QRegion &region, bool alphaOnly = false);
+    bool canUndo() const;
+    bool canRedo() const;
+    // Return the region of the image that has been changed
+    QRegion undo(ImageBuffer &buffer);
+    QRegion redo(ImageBuffer &buffer);
+    void clear();
+
+    static const int tileSize = 256;
+
+private:
+    struct Tile {
+        QRect rect;
+        QImage pixels; // null if the step only changes the alpha mask
+        BitMatrix alpha;
+    };
+
+    struct Step {
+        QRegion region;
+        std::vector<Tile> tiles;
+        qint64 bytes = 0;
+        std::unique_ptr<QTemporaryFile> spillFile; // non-null if tiles are on disk
+    };
+
+    static void swapTiles(Step &step, ImageBuffer &buffer);
+    static qint64 tileBytes(const Tile &tile);
+    bool spill(Step &step);
+    bool restore(Step &step);
+    void dropFront();
+    void dropBack();
+    void enforceLimits();
+
+    std::deque<Step> steps;
+    int current = 0; // steps before `current` can be undone, the rest can be redone
+    qint64 memoryBudget;
+    int maxSteps;
+    qint64 memoryInUse = 0;
+};
+
+
+#endif //POISSONEDITOR_HISTORY_H
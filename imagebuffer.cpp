@@ -0,0 +1,248 @@
+#include <cstring>
+#include <map>
+
+#include "imagebuffer.h"
+#include "utils.h"
+
+static const int tileSize = TileStore::tileSize;
+
+// Alpha tiles are kept as MonoLSB images, whose scanlines hold the bits in the order of BitMatrix rows
+static QImage toMono(const BitMatrix &bits, const QSize &size) {
+    QImage image(size, QImage::Format_MonoLSB);
+    for (int y = 0; y < size.height(); ++y)
+        memcpy(image.scanLine(y), bits.toBytes() + y * bits.rows(), static_cast<size_t>(bits.rows()));
+    return image;
+}
+
+static BitMatrix fromMono(const QImage &image) {
+    BitMatrix bits(image.width(), image.height());
+    for (int y = 0; y < image.height(); ++y)
+        memcpy(bits.toBytes() + y * bits.rows(), image.constScanLine(y), static_cast<size_t>(bits.rows()));
+    return bits;
+}
+
+static BitMatrix ones(int width, int height) {
+    BitMatrix bits(width, height);
+    bits.fill1();
+    return bits;
+}
+
+// Whether no pixel of a `width` wide matrix is erased, padding bits are ignored
+static bool allOpaque(const BitMatrix &bits, int width) {
+    const int fullBytes = width >> 3;
+    const auto tail = static_cast<uchar>((1 << (width & 7)) - 1);
+    for (int y = 0; y < bits.cols(); ++y) {
+        const uchar *row = bits.toBytes() + y * bits.rows();
+        for (int x = 0; x < fullBytes; ++x)
+            if (row[x] != 0xff) return false;
+        if (tail != 0 && (row[fullBytes] & tail) != tail) return false;
+    }
+    return true;
+}
+
+const QImage::Format ImageBuffer::colorFormat;
+const QImage::Format ImageBuffer::grayFormat;
+const QImage::Format ImageBuffer::alphaFormat;
+
+QImage::Format ImageBuffer::formatFor(const QImage &image) {
+    if (image.hasAlphaChannel()) return alphaFormat;
+    // Only checked by format, as testing every pixel of a color image would be slow
+    bool gray = image.format() == QImage::Format_Grayscale8
+                || (image.format() == QImage::Format_Indexed8 && image.isGrayscale());
+    return gray ? grayFormat : colorFormat;
+}
+
+ImageBuffer::ImageBuffer(const QImage &image)
+        : bounds(image.rect()), pixelFormat(formatFor(image)), image(image.convertToFormat(pixelFormat)),
+          alphaPlane(std::make_shared<BitMatrix>(image.width(), image.height())) {
+    alphaPlane->fill1();
+}
+
+ImageBuffer::ImageBuffer(const QImage &image, std::shared_ptr<TileStore> store)
+        : bounds(image.rect()), pixelFormat(formatFor(image)), store(std::move(store)) {
+    tileColumns = (bounds.width() + tileSize - 1) / tileSize;
+    int tileRows = (bounds.height() + tileSize - 1) / tileSize;
+    tiles.reserve(static_cast<size_t>(tileColumns) * tileRows);
+    // Converted tile by tile, so that no full size copy is made
+    for (int ty = 0; ty < tileRows; ++ty)
+        for (int tx = 0; tx < tileColumns; ++tx)
+            tiles.push_back(this->store->create(image.copy(tileRect(tx, ty)).convertToFormat(pixelFormat)));
+    alphaTiles.resize(tiles.size()); // nothing is erased yet
+}
+
+ImageBuffer::ImageBuffer(const QSize &size, QImage::Format format, std::shared_ptr<TileStore> store)
+        : bounds(QPoint(0, 0), size), pixelFormat(format), store(std::move(store)) {
+    assert(format == colorFormat || format == grayFormat || format == alphaFormat);
+    tileColumns = (bounds.width() + tileSize - 1) / tileSize;
+    int tileRows = (bounds.height() + tileSize - 1) / tileSize;
+    tiles.reserve(static_cast<size_t>(tileColumns) * tileRows);
+    // Tiles are immutable, so tiles of the same size share one black tile until written
+    std::map<std::pair<int, int>, TileStore::TilePtr> blank;
+    for (int ty = 0; ty < tileRows; ++ty)
+        for (int tx = 0; tx < tileColumns; ++tx) {
+            auto rect = tileRect(tx, ty);
+            auto &tile = blank[std::make_pair(rect.width(), rect.height())];
+            if (tile == nullptr) {
+                QImage pixels(rect.size(), pixelFormat);
+                pixels.fill(0);
+                tile = this->store->create(pixels);
+            }
+            tiles.push_back(tile);
+        }
+    alphaTiles.resize(tiles.size());
+}
+
+ImageBuffer::ImageBuffer(const QImage &pixels, BitMatrix alpha)
+        : bounds(pixels.rect()), pixelFormat(pixels.format()), image(pixels),
+          alphaPlane(std::make_shared<BitMatrix>(std::move(alpha))) {
+    assert((pixelFormat == colorFormat || pixelFormat == grayFormat || pixelFormat == alphaFormat)
+           && pixels.height() == alphaPlane->cols());
+}
+
+BitMatrix &ImageBuffer::alpha() {
+    assert(!isTiled());
+    if (alphaPlane.use_count() > 1)
+        alphaPlane = std::make_shared<BitMatrix>(*alphaPlane);
+    return *alphaPlane;
+}
+
+QRect ImageBuffer::tileRect(int x, int y) const {
+    return QRect(x * tileSize, y * tileSize, tileSize, tileSize).intersected(bounds);
+}
+
+TileStore::TilePtr &ImageBuffer::tileAt(int x, int y) {
+    return tiles[static_cast<size_t>(y) * tileColumns + x];
+}
+
+const TileStore::TilePtr &ImageBuffer::tileAt(int x, int y) const {
+    return tiles[static_cast<size_t>(y) * tileColumns + x];
+}
+
+TileStore::TilePtr &ImageBuffer::alphaTileAt(int x, int y) {
+    return alphaTiles[static_cast<size_t>(y) * tileColumns + x];
+}
+
+const TileStore::TilePtr &ImageBuffer::alphaTileAt(int x, int y) const {
+    return alphaTiles[static_cast<size_t>(y) * tileColumns + x];
+}
+
+QImage ImageBuffer::copy(const QRect &rect) const {
+    if (!isTiled()) return image.copy(rect);
+
+    QImage result(rect.size(), pixelFormat);
+    auto clipped = rect.intersected(bounds);
+    if (clipped != rect) result.fill(0); // same as QImage::copy outside the image
+    if (clipped.isEmpty()) return result;
+    for (int ty = clipped.top() / tileSize; ty <= clipped.bottom() / tileSize; ++ty)
+        for (int tx = clipped.left() / tileSize; tx <= clipped.right() / tileSize; ++tx) {
+            auto tile = tileRect(tx, ty);
+            auto part = tile.intersected(clipped);
+            utils::copyRect(result, part.topLeft() - rect.topLeft(), store->pixels(tileAt(tx, ty)),
+                            part.translated(-tile.topLeft()));
+        }
+    return result;
+}
+
+void ImageBuffer::write(const QPoint &pos, const QImage &patch) {
+    const QImage &source = patch.format() == pixelFormat ? patch : patch.convertToFormat(pixelFormat);
+    if (!isTiled()) {
+        utils::copyRect(image, pos, source);
+        return;
+    }
+
+    // Tiles are immutable, changed tiles are replaced so that copies of the buffer are not affected
+    QRect rect(pos, patch.size());
+    for (int ty = rect.top() / tileSize; ty <= rect.bottom() / tileSize; ++ty)
+        for (int tx = rect.left() / tileSize; tx <= rect.right() / tileSize; ++tx) {
+            auto tile = tileRect(tx, ty);
+            auto part = tile.intersected(rect);
+            QImage pixels;
+            if (part == tile) {
+                pixels = source.copy(part.translated(-pos));
+            } else {
+                pixels = store->pixels(tileAt(tx, ty));
+                utils::copyRect(pixels, part.topLeft() - tile.topLeft(), source, part.translated(-pos));
+            }
+            tileAt(tx, ty) = store->create(pixels);
+        }
+}
+
+BitMatrix ImageBuffer::copyAlpha(const QRect &rect) const {
+    assert(bounds.contains(rect));
+    if (!isTiled()) return alphaPlane->subMatrix(rect.x(), rect.y(), rect.width(), rect.height());
+
+    // Starts out erased, so that tiles can be merged in with subMatrixOr
+    BitMatrix result(rect.width(), rect.height());
+    for (int ty = rect.top() / tileSize; ty <= rect.bottom() / tileSize; ++ty)
+        for (int tx = rect.left() / tileSize; tx <= rect.right() / tileSize; ++tx) {
+            auto tile = tileRect(tx, ty);
+            auto part = tile.intersected(rect);
+            const auto &alphaTile = alphaTileAt(tx, ty);
+            if (alphaTile == nullptr) {
+                result.subMatrixOr(ones(part.width(), part.height()), part.x() - rect.x(), part.y() - rect.y());
+            } else {
+                BitMatrix bits = fromMono(store->pixels(alphaTile));
+                result.subMatrixOr(bits.subMatrix(part.x() - tile.x(), part.y() - tile.y(), part.width(), part.height()),
+                                   part.x() - rect.x(), part.y() - rect.y());
+            }
+        }
+    return result;
+}
+
+void ImageBuffer::writeAlpha(const QRect &rect, const BitMatrix &alpha) {
+    assert(bounds.contains(rect) && alpha.cols() == rect.height());
+    if (!isTiled()) {
+        this->alpha().setSubMatrix(alpha, rect.x(), rect.y());
+        return;
+    }
+
+    // Replaced like pixel tiles; tiles that end up without erased pixels are dropped
+    for (int ty = rect.top() / tileSize; ty <= rect.bottom() / tileSize; ++ty)
+        for (int tx = rect.left() / tileSize; tx <= rect.right() / tileSize; ++tx) {
+            auto tile = tileRect(tx, ty);
+            auto part = tile.intersected(rect);
+            auto &alphaTile = alphaTileAt(tx, ty);
+            BitMatrix bits = alphaTile == nullptr ? ones(tile.width(), tile.height()) : fromMono(store->pixels(alphaTile));
+            bits.setSubMatrix(alpha.subMatrix(part.x() - rect.x(), part.y() - rect.y(), part.width(), part.height()),
+                              part.x() - tile.x(), part.y() - tile.y());
+            alphaTile = allOpaque(bits, tile.width()) ? nullptr : store->create(toMono(bits, tile.size()));
+        }
+}
+
+QImage ImageBuffer::composite(const QRect &rect) const {
+    // Transparency of the pixels themselves is kept by the conversion, only erased pixels need to be touched
+    QImage result = copy(rect).convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    // Tiled buffers only assemble the alpha plane of the rect
+    const BitMatrix tiledMask = isTiled() ? copyAlpha(rect) : BitMatrix(0, 0);
+    const BitMatrix &mask = isTiled() ? tiledMask : *alphaPlane;
+    const QPoint origin = isTiled() ? QPoint(0, 0) : rect.topLeft();
+    for (int y = 0; y < rect.height(); ++y) {
+        auto *line = reinterpret_cast<QRgb *>(result.scanLine(y));
+        for (int x = 0; x < rect.width(); ++x)
+            if (!mask(origin.x() + x, origin.y() + y)) line[x] = 0;
+    }
+    return result;
+}
+
+void ImageBuffer::prefetch(const QRect &rect) const {
+    auto clipped = rect.intersected(bounds);
+    if (!isTiled() || clipped.isEmpty()) return;
+    std::vector<TileStore::TilePtr> wanted;
+    for (int ty = clipped.top() / tileSize; ty <= clipped.bottom() / tileSize; ++ty)
+        for (int tx = clipped.left() / tileSize; tx <= clipped.right() / tileSize; ++tx) {
+            wanted.push_back(tileAt(tx, ty));
+            if (alphaTileAt(tx, ty) != nullptr) wanted.push_back(alphaTileAt(tx, ty));
+        }
+    store->prefetch(wanted);
+}
+
+void ImageBuffer::convertToColor() {
+    if (pixelFormat != grayFormat) return;
+    pixelFormat = colorFormat;
+    if (!isTiled()) {
+        image = image.convertToFormat(colorFormat);
+        return;
+    }
+    for (auto &tile : tiles)
+        tile = store->create(store->pixels(tile).convertToFormat(colorFormat));
+}
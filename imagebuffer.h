@@ -0,0 +1,113 @@
+#ifndef POISSONEDITOR_IMAGEBUFFER_H
+#define POISSONEDITOR_IMAGEBUFFER_H
+
+#include <memory>
+#include <vector>
+
+#include <QImage>
+
+#include "bitmatrix.h"
+#include "tilestore.h"
+
+
+// Canonical storage of the image being edited
+// Pixels are kept in RGB32, in ARGB32 for sources with an alpha channel or in Grayscale8
+// for grayscale sources; erased pixels are tracked in a separate alpha plane. Both planes are
+// implicitly shared: copying a buffer is cheap and a plane is only detached when it is written
+// while another copy still refers to it.
+// Images too large for memory keep their pixels and alpha plane in tiles of a TileStore
+// instead, which are shared the same way; only the region API (copy, write, copyAlpha,
+// writeAlpha, composite) is then available. Alpha tiles only exist where pixels are erased.
+class ImageBuffer {
+public:
+    static const QImage::Format colorFormat = QImage::Format_RGB32;
+    static const QImage::Format grayFormat = QImage::Format_Grayscale8;
+    // Used instead of colorFormat for sources with transparency, which is kept on save
+    static const QImage::Format alphaFormat = QImage::Format_ARGB32;
+    // Format in which `image` is kept
+    static QImage::Format formatFor(const QImage &image);
+
+    ImageBuffer() = default;
+    explicit ImageBuffer(const QImage &image);
+    // Keep the pixels in tiles of `store`
+    ImageBuffer(const QImage &image, std::shared_ptr<TileStore> store);
+    // Tiled buffer of `size` in `format`, black with nothing erased, whose pixels are then written
+    // band by band for images that cannot be held by a single QImage
+    ImageBuffer(const QSize &size, QImage::Format format, std::shared_ptr<TileStore> store);
+    // Take planes as they are, `pixels` must be in the buffer format
+    ImageBuffer(const QImage &pixels, BitMatrix alpha);
+
+    inline bool isNull() const {
+        return bounds.isEmpty();
+    }
+
+    inline QImage::Format format() const {
+        return pixelFormat;
+    }
+
+    inline bool isTiled() const {
+        return store != nullptr;
+    }
+
+    inline QSize size() const {
+        return bounds.size();
+    }
+
+    inline QRect rect() const {
+        return bounds;
+    }
+
+    // Only available if the buffer is not tiled
+    inline const QImage &pixels() const {
+        assert(!isTiled());
+        return image;
+    }
+
+    inline QImage &pixels() {
+        assert(!isTiled());
+        return image; // QImage detaches itself on write
+    }
+
+    // Only available if the buffer is not tiled
+    inline const BitMatrix &alpha() const {
+        assert(!isTiled());
+        return *alphaPlane;
+    }
+
+    BitMatrix &alpha();
+
+    // Alpha plane inside `rect`, which must lie inside the buffer
+    BitMatrix copyAlpha(const QRect &rect) const;
+    // Overwrite the alpha plane inside `rect` with `alpha`, which must be of the same size
+    void writeAlpha(const QRect &rect, const BitMatrix &alpha);
+
+    // Pixels inside `rect`, in the buffer format
+    QImage copy(const QRect &rect) const;
+    // Overwrite pixels with `patch` placed at `pos`
+    void write(const QPoint &pos, const QImage &patch);
+    // Premultiplied ARGB pixels inside `rect`, with erased pixels transparent
+    QImage composite(const QRect &rect) const;
+    // Hint that pixels inside `rect` will be accessed soon
+    void prefetch(const QRect &rect) const;
+    // Switch a grayscale buffer to colorFormat, other buffers are left as they are
+    void convertToColor();
+
+private:
+    QRect tileRect(int x, int y) const;
+    TileStore::TilePtr &tileAt(int x, int y);
+    const TileStore::TilePtr &tileAt(int x, int y) const;
+    TileStore::TilePtr &alphaTileAt(int x, int y);
+    const TileStore::TilePtr &alphaTileAt(int x, int y) const;
+
+    QRect bounds;
+    QImage::Format pixelFormat = colorFormat;
+    QImage image; // null if tiled
+    std::shared_ptr<TileStore> store;
+    std::vector<TileStore::TilePtr> tiles; // row-major
+    std::vector<TileStore::TilePtr> alphaTiles; // same layout, null for tiles without erased pixels
+    int tileColumns = 0;
+    std::shared_ptr<BitMatrix> alphaPlane; // null if tiled
+};
+
+
+#endif //POISSONEDITOR_IMAGEBUFFER_H
@@ -1,10 +1,16 @@
 #ifndef POISSONEDITOR_IMAGEMAGIC_H
 #define POISSONEDITOR_IMAGEMAGIC_H
 
+#include <map>
+#include <memory>
+#include <tuple>
+
 #include <QImage>
-#include <QColor>
+#include <QPoint>
+#include <QString>
 
 #include "bitmatrix.h"
+#include "poissonsolver.h"
 
 namespace ImageMagic {
 
@@ -13,41 +19,67 @@ namespace ImageMagic {
                                   {0,  -1},
                                   {-1, 0}};
 
-    struct Color {
-        int col[3];
-
-        inline Color() { memset(col, 0, sizeof col); }
-
-        inline Color(const QColor &color) {
-            col[0] = color.red(), col[1] = color.green(), col[2] = color.blue();
-        }
-
-        inline Color(int r, int g, int b) {
-            col[0] = r, col[1] = g, col[2] = b;
-        }
-
-        inline void operator +=(const Color &rhs) {
-            col[0] += rhs.col[0];
-            col[1] += rhs.col[1];
-            col[2] += rhs.col[2];
-        }
-
-        inline Color operator +(const Color &rhs) {
-            return {col[0] + rhs.col[0], col[1] + rhs.col[1], col[2] + rhs.col[2]};
-        }
-
-        inline Color operator -(const Color &rhs) {
-            return {col[0] - rhs.col[0], col[1] - rhs.col[1], col[2] - rhs.col[2]};
-        }
-
-        inline int norm() const {
-            return col[0] * col[0] + col[1] * col[1] + col[2] * col[2];
-        }
+    // Fuse the pixels of `image` inside `mask` into `originalImage`, with `stats` of the solve
+    QImage poissonFusion(const QImage &originalImage, const QImage &image, const QImage &mask,
+                         PoissonSolver::Stats *stats = nullptr);
+
+    struct FusionSystem;
+
+    // Fusion of the same patch into a sequence of frames, such as the frames of a video
+    // The patch is its pixels with nonzero alpha, placed at a possibly different offset in each
+    // frame. The system only depends on the part of the patch inside the frame, so it is
+    // factorized once and reused for every frame that clips the patch the same way.
+    class SequenceFusion {
+        QImage patch, mask;
+        // Keyed by the size of the fused region and the position of the patch in it
+        std::map<std::tuple<int, int, int, int>, std::unique_ptr<FusionSystem>> systems;
+
+    public:
+        explicit SequenceFusion(const QImage &patch);
+        ~SequenceFusion();
+
+        // The frame with the patch fused at `offset`, frames are expected in order
+        // Iterative solvers start from the solution of the previous frame clipped the same way.
+        // The result keeps the format of the frame, or is ARGB32 for indexed and other formats
+        // without a specialized layout.
+        QImage fuse(const QImage &frame, const QPoint &offset, PoissonSolver::Stats *stats = nullptr);
     };
 
-    QImage poissonFusion(const QImage &originalImage, const QImage &image, const QImage &mask);
+    struct SmartFillOptions {
+        static const int maxWindowSize = 63;
+
+        // Side of the square windows compared when looking for patches, odd and at most maxWindowSize
+        int windowSize = 11;
+        // Window size from which the windows are compared by FFT cross-correlation instead of
+        // directly, the crossover measured by --benchmark
+        int fftCrossover = 21;
+        // Targets filled per iteration, the ones with the highest priority whose windows do not
+        // overlap; their sources are searched for in parallel. 1 fills one target at a time.
+        int batchSize = 1;
+        // Sources are searched for within this many pixels of the target first, 0 searches the
+        // whole image. The radius is doubled while no source is found or, when poorMatchRms is
+        // positive, while the root mean square difference of the best match exceeds it.
+        int searchRadius = 0;
+        float poorMatchRms = 0;
+        // When positive, each hole is filled on its own from the pixels within this margin around
+        // it, at the same time as the others, with memory and time depending on the holes only
+        int sourceMargin = 0;
+        // Directory for checkpoints, none are written if empty. A fill saves its state there every
+        // checkpointInterval seconds, continues from it when run again on the same input, and
+        // removes it when done.
+        QString checkpointDirectory;
+        int checkpointInterval = 30;
+        // Checkpoints left by fills that never finished are removed when a fill starts, once older
+        // than checkpointMaxAgeDays, and the oldest first while they take more than checkpointMaxMB
+        int checkpointMaxAgeDays = 7;
+        int checkpointMaxMB = 1024;
+
+        // Options of the smartFill/* settings, with the defaults of the editor
+        static SmartFillOptions fromSettings();
+    };
 
-    QImage smartFill(const QImage &image, const BitMatrix &mask);
+    // Fill pixels outside `mask` in place
+    void smartFill(QImage &image, const BitMatrix &mask, const SmartFillOptions &options = SmartFillOptions());
 
 }
 
@@ -20,6 +20,11 @@ ImageScene::ImageScene() {
     pathItem->setBrush(QBrush(QColor(0, 100, 200, 50))); // half-transparent light blue
     pathItem->setZValue(1); // put on top of everything else
     addItem(pathItem);
+
+    QSettings settings(QCoreApplication::organizationName(), QCoreApplication::applicationName());
+    history.setMemoryBudget(settings.value("history/memoryBudgetMB", 256).toLongLong() << 20);
+    history.setMaxSteps(settings.value("history/maxSteps", 100).toInt());
+    smartFillOptions = ImageMagic::SmartFillOptions::fromSettings();
 }
 
 ImageScene::~ImageScene() {
@@ -27,30 +32,65 @@ ImageScene::~ImageScene() {
     delete pathPen;
     delete pathItem;
     delete imageItem;
-    delete bgAlpha;
 }
 
-void ImageScene::setPixmap(const QPixmap &pixmap) {
+void ImageScene::setPlaceholder(const QSize &size) {
+    setSceneRect(QRect(QPoint(0, 0), size));
+    delete placeholderItem;
+    placeholderItem = addRect(sceneRect(), Qt::NoPen, QBrush(Qt::lightGray));
+}
+
+void ImageScene::setPreview(const QImage &preview) {
+    delete placeholderItem;
+    auto *item = new QGraphicsPixmapItem(QPixmap::fromImage(preview));
+    item->setTransformationMode(Qt::SmoothTransformation);
+    item->setScale(sceneRect().width() / preview.width());
+    addItem(item);
+    placeholderItem = item;
+}
+
+void ImageScene::setProject(const ProjectFile::Project &project) {
+    setBuffer(project.buffer);
+    erasedRect = project.erasedRect;
+    if (!project.lassoPath.isEmpty()) {
+        lassoPath = project.lassoPath;
+        pathItem->setPath(lassoPath.simplified());
+        hasLassoSelection = true;
+    }
+    for (const auto &patch : project.patches) {
+        auto *item = new QGraphicsPixmapItem(QPixmap::fromImage(patch.image));
+        item->setPos(patch.pos);
+        item->setZValue(patch.zValue);
+        maxZValue = qMax(maxZValue, static_cast<float>(patch.zValue));
+        addItem(item);
+        pastedPixmaps.append(item);
+    }
+}
+
+void ImageScene::setBuffer(const ImageBuffer &buffer) {
+    delete placeholderItem;
+    placeholderItem = nullptr;
     if (imageItem != nullptr)
         removeItem(imageItem);
+    delete imageItem;
 
-    setSceneRect(pixmap.rect());
-    this->pixmap = pixmap;
-    originalImage = pixmap.toImage();
-    imageSize = pixmap.size();
+    this->buffer = buffer;
+    imageSize = buffer.size();
+    setSceneRect(buffer.rect());
 
     if (imageSize.width() <= 300 && imageSize.height() <= 300) {
         pathPen->setWidth(1);
         pathItem->setPen(*pathPen);
     }
 
-    imageItem = new QGraphicsPixmapItem(pixmap);
+    imageItem = new TiledImageItem;
+    imageItem->setBuffer(&this->buffer);
     imageItem->setZValue(0);
-    imageItem->setTransformationMode(Qt::SmoothTransformation);
     addItem(imageItem);
 
-    bgAlpha = new BitMatrix(imageSize.width(), imageSize.height());
-    bgAlpha->fill1();
+    erasedRect = QRect();
+    history.clear();
+    emit historyChanged();
 }
 
 const QPainterPath *ImageScene::getSelection() const {
@@ -78,6 +118,7 @@ void ImageScene::clearSelection() {
 }
 
 void ImageScene::pastePixmap(const QPixmap &pixmap) {
+    if (imageItem == nullptr) return;
     auto *item = new QGraphicsPixmapItem(pixmap);
     item->setPos((imageSize.width() - pixmap.width()) / 2, (imageSize.height() - pixmap.height()) / 2);
     maxZValue += 0.1;
@@ -92,6 +133,7 @@ const QList<QGraphicsPixmapItem *> &ImageScene::getPastedPixmaps() const {
 }
 
 void ImageScene::poissonFusion() {
+    if (imageItem == nullptr) return;
     clearSelection();
 
     // Sort patches by ascending z-value
@@ -99,37 +141,63 @@ void ImageScene::poissonFusion() {
         return a->zValue() < b->zValue();
     });
     // Align pixmaps to pixel edge
-    for (auto *item : pastedPixmaps)
-        item->setPos(item->pos().toPoint());
-
-    // Render the current scene to pixmap
-    QImage image(imageSize, QImage::Format_ARGB32);
-    QPainter imagePainter(&image);
-    render(&imagePainter);
-
-    // Create segmentation mask
-    QImage mask(imageSize, QImage::Format_Grayscale8);
-    mask.fill(0);
-    QPainter maskPainter(&mask);
-    int index = 0;
+    QRect patchRect;
     for (auto *item : pastedPixmaps) {
-        ++index;
-//        index += 50;
-        QPixmap patch(item->pixmap().size());
-        patch.fill(QColor::fromHsv(0, 0, index));
-        patch.setMask(item->pixmap().mask());
-        maskPainter.drawPixmap(item->pos(), patch);
+        item->setPos(item->pos().toPoint());
+        patchRect |= item->sceneBoundingRect().toAlignedRect();
+    }
+    // Only the patches and a margin around them take part in the fusion
+    const int margin = 2;
+    auto roi = patchRect.adjusted(-margin, -margin, margin, margin).intersected(QRect(QPoint(0, 0), imageSize));
+    // Fusion replaces pixels under the patches and restores all erased pixels
+    history.record(buffer, QRegion(roi) + erasedRect);
+
+    if (!roi.isEmpty()) {
+        // Render the region of interest of the current scene
+        QImage image(roi.size(), QImage::Format_ARGB32);
+        image.fill(Qt::transparent);
+        QPainter imagePainter(&image);
+        render(&imagePainter, QRectF(image.rect()), QRectF(roi));
+        imagePainter.end();
+
+        // Create segmentation mask
+        QImage mask(roi.size(), QImage::Format_Grayscale8);
+        mask.fill(0);
+        QPainter maskPainter(&mask);
+        int index = 0;
+        for (auto *item : pastedPixmaps) {
+            ++index;
+//            index += 50;
+            QPixmap patch(item->pixmap().size());
+            patch.fill(QColor::fromHsv(0, 0, index));
+            patch.setMask(item->pixmap().mask());
+            maskPainter.drawPixmap(item->pos() - roi.topLeft(), patch);
+        }
+        maskPainter.end();
+
+        // Grayscale buffers stay grayscale as long as the patches are grayscale too
+        if (buffer.format() == ImageBuffer::grayFormat) {
+            bool gray = true;
+            for (auto *item : pastedPixmaps)
+                gray = gray && item->pixmap().toImage().isGrayscale();
+            if (!gray) buffer.convertToColor();
+        }
+        auto fusedImage = ImageMagic::poissonFusion(buffer.copy(roi), image, mask);
+        buffer.write(roi.topLeft(), fusedImage);
     }
-    auto fusedImage = ImageMagic::poissonFusion(originalImage, image, mask); // pixmap should not be used because of its mask
-    pixmap = QPixmap::fromImage(fusedImage);
-    originalImage = fusedImage; // so as to allow fusion for multiple times
 
     // Clear all pasted patches & mask
-    bgAlpha->fill1();
+    if (!erasedRect.isEmpty()) {
+        BitMatrix opaque(erasedRect.width(), erasedRect.height());
+        opaque.fill1();
+        buffer.writeAlpha(erasedRect, opaque);
+    }
+    refreshRegion(QRegion(roi) + erasedRect);
+    erasedRect = QRect();
     for (auto *item : pastedPixmaps)
         removeItem(item);
     pastedPixmaps.clear();
-    imageItem->setPixmap(pixmap);
+    emit historyChanged();
 }
 
 void ImageScene::smartFill() {
@@ -147,14 +215,58 @@ void ImageScene::smartFill() {
 
     auto filledImage = ImageMagic::smartFill(image, bitmat);
 */
-    auto filledImage = ImageMagic::smartFill(pixmap.toImage(), *bgAlpha);
+    if (imageItem == nullptr || erasedRect.isEmpty()) return;
+    history.record(buffer, erasedRect);
+    if (!buffer.isTiled()) {
+        ImageMagic::smartFill(buffer.pixels(), buffer.alpha(), smartFillOptions); // only erased pixels are written
+    } else {
+        // Patches are only searched for around the erased pixels, so the whole image is never loaded
+        const int margin = smartFillOptions.sourceMargin > 0 ? smartFillOptions.sourceMargin : 256;
+        auto roi = erasedRect.adjusted(-margin, -margin, margin, margin).intersected(buffer.rect());
+        QImage image = buffer.copy(roi);
+        ImageMagic::smartFill(image, buffer.copyAlpha(roi), smartFillOptions);
+        buffer.write(roi.topLeft(), image);
+    }
 //    auto filledImage = QBitmap::fromData(pixmap.size(), bitmat.toBytes(), QImage::Format_MonoLSB).toImage();
-//    auto filledImage = image;
-    pixmap = QPixmap::fromImage(filledImage);
-    originalImage = filledImage;
 
-    bgAlpha->fill1();
-    imageItem->setPixmap(pixmap);
+    BitMatrix opaque(erasedRect.width(), erasedRect.height());
+    opaque.fill1();
+    buffer.writeAlpha(erasedRect, opaque);
+    refreshRegion(erasedRect);
+    erasedRect = QRect();
+    emit historyChanged();
+}
+
+bool ImageScene::canUndo() const {
+    return history.canUndo();
+}
+
+bool ImageScene::canRedo() const {
+    return history.canRedo();
+}
+
+void ImageScene::undo() {
+    if (imageItem == nullptr || !history.canUndo()) return;
+    clearSelection();
+    auto region = history.undo(buffer);
+    erasedRect |= region.boundingRect();
+    refreshRegion(region);
+    emit historyChanged();
+}
+
+void ImageScene::redo() {
+    if (imageItem == nullptr || !history.canRedo()) return;
+    clearSelection();
+    auto region = history.redo(buffer);
+    erasedRect |= region.boundingRect();
+    refreshRegion(region);
+    emit historyChanged();
+}
+
+// Update the view after the buffer is changed inside region
+void ImageScene::refreshRegion(const QRegion &region) {
+    for (const QRect &rect : region.rects())
+        imageItem->invalidate(rect);
 }
 
 void ImageScene::mousePressEvent(QGraphicsSceneMouseEvent *event) {
@@ -345,24 +457,33 @@ QPixmap ImageScene::getSelectedImage() {
     auto boundingRect = utils::toAlignedRect(path->boundingRect());
     auto bitMatrix = getMaskFromPath(*path);
     auto mask = QBitmap::fromData(boundingRect.size(), bitMatrix.toBytes(), QImage::Format_MonoLSB);
-    selectedImage = pixmap.copy(boundingRect);
+    selectedImage = QPixmap::fromImage(buffer.composite(boundingRect));
     selectedImage.setMask(mask);
 
     return selectedImage;
 }
 
-QImage ImageScene::getImage() {
-    return pixmap.toImage();
+ProjectFile::Project ImageScene::toProject() const {
+    ProjectFile::Project project;
+    project.buffer = buffer;
+    project.erasedRect = erasedRect;
+    if (hasLassoSelection) project.lassoPath = lassoPath;
+    for (auto *item : pastedPixmaps)
+        project.patches.append({item->pixmap().toImage(), item->pos(), item->zValue()});
+    return project;
 }
 
 void ImageScene::eraseLassoSelection() {
     auto *path = getSelection();
     auto boundingRect = utils::toAlignedRect(path->boundingRect());
     auto bitMatrix = getMaskFromPath(*path);
-    bitMatrix.invert();
-    bgAlpha->subMatrixAnd(bitMatrix, boundingRect.x(), boundingRect.y());
-    auto mask = QBitmap::fromData(imageSize, bgAlpha->toBytes(), QImage::Format_MonoLSB);
-    pixmap.setMask(mask);
-    imageItem->setPixmap(pixmap);
+    history.record(buffer, boundingRect, true);
+    erasedRect |= boundingRect;
+    // Only the bounding rect of the selection is touched, in both the alpha plane and the view
+    BitMatrix alpha = buffer.copyAlpha(boundingRect);
+    alpha.subMatrixAndNot(bitMatrix, 0, 0);
+    buffer.writeAlpha(boundingRect, alpha);
+    imageItem->invalidate(boundingRect);
     clearSelection();
+    emit historyChanged();
 }
@@ -8,6 +8,11 @@
 
 #include "utils.h"
 #include "bitmatrix.h"
+#include "imagebuffer.h"
+#include "tiledimageitem.h"
+#include "history.h"
+#include "imagemagic.h"
+#include "projectfile.h"
 
 
 class ImageScene : public QGraphicsScene {
@@ -21,17 +26,31 @@ public:
     ImageScene &operator =(const ImageScene &) = delete;
     ImageScene &operator =(ImageScene &&) = delete;
 
-    void setPixmap(const QPixmap &pixmap);
+    void setPlaceholder(const QSize &size);
+    void setPreview(const QImage &preview);
+    // Tiled or not, as decided by whoever built the buffer
+    void setBuffer(const ImageBuffer &buffer);
+    void setProject(const ProjectFile::Project &project);
+    // The buffer in the project shares its planes with the scene, they are detached when the scene is edited later
+    ProjectFile::Project toProject() const;
     const QPainterPath *getSelection() const;
     void clearSelection();
     void pastePixmap(const QPixmap &pixmap);
     const QList<QGraphicsPixmapItem *> &getPastedPixmaps() const;
     QPixmap getSelectedImage();
-    QImage getImage();
 
     void poissonFusion();
     void smartFill();
 
+    bool canUndo() const;
+    bool canRedo() const;
+    void undo();
+    void redo();
+
+signals:
+    // Emitted when steps are recorded, undone or redone, or the history is cleared
+    void historyChanged();
+
 protected:
     void mousePressEvent(QGraphicsSceneMouseEvent *event) override;
     void mouseMoveEvent(QGraphicsSceneMouseEvent *event) override;
@@ -43,11 +62,12 @@ private:
     BitMatrix getMaskFromPath(const QPainterPath &path);
     QPointF clampedPoint(const QPointF &point);
     void eraseLassoSelection();
+    void refreshRegion(const QRegion &region);
 
-    QPixmap pixmap;
-    QImage originalImage;
+    ImageBuffer buffer;
     QSize imageSize;
-    QGraphicsPixmapItem *imageItem = nullptr;
+    TiledImageItem *imageItem = nullptr;
+    QGraphicsItem *placeholderItem = nullptr; // shown until the image is decoded
 
     bool inLassoSelection = false, hasLassoSelection = false;
     QPainterPath lassoPath;
@@ -55,7 +75,10 @@ private:
     QPen *pathPen;
     QVariantAnimation *pathBorderAnimation;
 
-    BitMatrix *bgAlpha = nullptr;
+    QRect erasedRect; // contains all erased pixels of the buffer
+
+    History history;
+    ImageMagic::SmartFillOptions smartFillOptions;
 
     QPixmap selectedImage;
     QPainterPath *selectionPath = nullptr;
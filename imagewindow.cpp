@@ -1,8 +1,36 @@
+#include <climits>
 #include <queue>
 
+#include <QtConcurrent>
+
 #include "imagewindow.h"
 
 
+static const int previewExtent = 512;
+
+// Previews get their own pool so they are not queued behind full decodes of other files
+static QThreadPool *previewPool() {
+    static QThreadPool pool;
+    return &pool;
+}
+
+// Counts the bytes written so far, so that the progress of a save can be shown
+class CountingSaveFile : public QSaveFile {
+public:
+    CountingSaveFile(const QString &name, QAtomicInteger<qint64> *counter) : QSaveFile(name), counter(counter) {}
+
+protected:
+    qint64 writeData(const char *data, qint64 len) override {
+        qint64 written = QSaveFile::writeData(data, len);
+        if (written > 0) counter->fetchAndAddRelaxed(written);
+        return written;
+    }
+
+private:
+    QAtomicInteger<qint64> *counter;
+};
+
+
 ImageWindow::ImageWindow(QWidget *parent) : QMainWindow(parent) {
     scene = new ImageScene;
     view = new QGraphicsView(scene);
@@ -21,6 +49,14 @@ ImageWindow::ImageWindow(QWidget *parent) : QMainWindow(parent) {
     statusBar()->addWidget(zoomSlider);
     zoomScaleLabel = new QLabel;
     statusBar()->addWidget(zoomScaleLabel);
+    saveStatusLabel = new QLabel;
+    statusBar()->addPermanentWidget(saveStatusLabel);
+    saveProgressBar = new QProgressBar;
+    saveProgressBar->setFixedWidth(100);
+    saveProgressBar->setRange(0, 0); // the encoded size is not known in advance
+    statusBar()->addPermanentWidget(saveProgressBar);
+    saveStatusLabel->hide();
+    saveProgressBar->hide();
 
     connect(zoomSlider, &QSlider::sliderMoved, [&](int value) {
         double actualScale = value <= 100
@@ -32,13 +68,23 @@ ImageWindow::ImageWindow(QWidget *parent) : QMainWindow(parent) {
     });
 
     setSlider(1.0);
+
+    connect(scene, &ImageScene::historyChanged, this, &ImageWindow::historyChanged);
+    connect(&previewWatcher, &QFutureWatcher<DecodedImage>::finished, this, &ImageWindow::previewDecoded);
+    connect(&imageWatcher, &QFutureWatcher<DecodedImage>::finished, this, &ImageWindow::imageDecoded);
+    connect(&saveWatcher, &QFutureWatcher<QString>::finished, this, &ImageWindow::saveFinished);
+    saveProgressTimer.setInterval(100);
+    connect(&saveProgressTimer, &QTimer::timeout, this, &ImageWindow::updateSaveProgress);
 }
 
 ImageWindow::~ImageWindow() {
+    saveWatcher.waitForFinished(); // the worker writes to `bytesWritten`
     delete view;
     delete scene;
     delete zoomSlider;
     delete zoomScaleLabel;
+    delete saveStatusLabel;
+    delete saveProgressBar;
 }
 
 void ImageWindow::setSlider(double scale) {
@@ -58,24 +104,168 @@ void ImageWindow::setSlider(double scale) {
 }
 
 bool ImageWindow::loadFile(const QString &filePath) {
+    if (ProjectFile::isProjectFile(filePath))
+        return loadProject(filePath);
+
+    // Only the header is read here, pixels are decoded on the thread pool
     QImageReader reader(filePath);
     reader.setAutoTransform(true);
-    const QImage image = reader.read();
-    if (image.isNull()) {
+    if (!reader.canRead()) {
         QMessageBox::information(this, QGuiApplication::applicationDisplayName(),
                                  tr("Cannot load %1: %2").arg(QDir::toNativeSeparators(filePath), reader.errorString()));
         return false;
     }
 
-    originalImage = QPixmap::fromImage(image);
-    scene->setPixmap(originalImage);
-    imageSize = image.size();
-
+    QSize storedSize = reader.size();
+    imageSize = storedSize;
+    if (reader.transformation() & QImageIOHandler::TransformationRotate90)
+        imageSize.transpose();
+    scene->setPlaceholder(imageSize);
     setWindowFilePath(QFileInfo(filePath).canonicalFilePath());
 
+    // Show a downscaled preview first if the format can decode one cheaply (e.g. JPEG DCT scaling)
+    if (storedSize.isValid() && reader.supportsOption(QImageIOHandler::ScaledSize)
+        && qMax(storedSize.width(), storedSize.height()) > previewExtent) {
+        auto previewSize = storedSize.scaled(previewExtent, previewExtent, Qt::KeepAspectRatio);
+        previewWatcher.setFuture(QtConcurrent::run(previewPool(), &ImageWindow::decode, filePath, previewSize));
+    }
+    imageWatcher.setFuture(QtConcurrent::run(&ImageWindow::decodeBuffer, filePath));
+
     return true;
 }
 
+// Projects are mapped into memory or copied into tiles instead of being decoded, so they are
+// loaded right away
+bool ImageWindow::loadProject(const QString &filePath) {
+    ProjectFile::Project project;
+    QString errorString;
+    if (!ProjectFile::read(filePath, project, &errorString)) {
+        QMessageBox::information(this, QGuiApplication::applicationDisplayName(),
+                                 tr("Cannot load %1: %2").arg(QDir::toNativeSeparators(filePath), errorString));
+        return false;
+    }
+    scene->setProject(project);
+    imageSize = project.buffer.size();
+    setWindowFilePath(QFileInfo(filePath).canonicalFilePath());
+    loaded = true;
+    // Queued, so that the signal can be connected after this call returns
+    QMetaObject::invokeMethod(this, "fileLoaded", Qt::QueuedConnection,
+                              Q_ARG(QString, windowFilePath()), Q_ARG(bool, true));
+    return true;
+}
+
+ImageWindow::DecodedImage ImageWindow::decode(const QString &filePath, const QSize &scaledSize) {
+    QImageReader reader(filePath);
+    reader.setAutoTransform(true);
+    if (scaledSize.isValid())
+        reader.setScaledSize(scaledSize);
+    DecodedImage result;
+    result.image = reader.read();
+    if (result.image.isNull())
+        result.errorString = reader.errorString();
+    return result;
+}
+
+// The image in the orientation given by `transformation`, the way QImageReader applies it
+static QImage transformed(const QImage &image, QImageIOHandler::Transformations transformation) {
+    if (transformation == QImageIOHandler::TransformationRotate270)
+        return image.transformed(QTransform().rotate(270));
+    QImage result = image.mirrored(transformation & QImageIOHandler::TransformationMirror,
+                                   transformation & QImageIOHandler::TransformationFlip);
+    return transformation & QImageIOHandler::TransformationRotate90 ? result.transformed(QTransform().rotate(90)) : result;
+}
+
+// Where `rect` of an image of `size` ends up in the image transformed the same way
+static QRect transformed(const QRect &rect, const QSize &size, QImageIOHandler::Transformations transformation) {
+    if (transformation == QImageIOHandler::TransformationRotate270)
+        return QRect(rect.y(), size.width() - 1 - rect.right(), rect.height(), rect.width());
+    QRect result = rect;
+    if (transformation & QImageIOHandler::TransformationMirror)
+        result.moveLeft(size.width() - 1 - rect.right());
+    if (transformation & QImageIOHandler::TransformationFlip)
+        result.moveTop(size.height() - 1 - rect.bottom());
+    if (transformation & QImageIOHandler::TransformationRotate90)
+        result = QRect(size.height() - 1 - result.bottom(), result.x(), result.height(), result.width());
+    return result;
+}
+
+// Images to keep in tiles are decoded a band of rows at a time if the format can decode part of
+// an image, so that no image of the full size is made
+ImageWindow::DecodedImage ImageWindow::decodeBuffer(const QString &filePath) {
+    QImageReader reader(filePath);
+    reader.setAutoTransform(true);
+    DecodedImage result;
+    auto store = TileStore::global();
+    const QSize storedSize = reader.size();
+    const auto transformation = reader.transformation();
+    QSize size = storedSize;
+    if (transformation & QImageIOHandler::TransformationRotate90)
+        size.transpose();
+    // The format of the buffer is only known once pixels are decoded, assume the widest
+    const int depth = reader.imageFormat() == QImage::Format_Invalid
+                      ? 32 : QImage(1, 1, ImageBuffer::formatFor(QImage(1, 1, reader.imageFormat()))).depth();
+    const bool tiled = storedSize.isValid() && store->shouldTile(size, depth);
+
+    if (!tiled || !reader.supportsOption(QImageIOHandler::ClipRect)) {
+        QImage image = reader.read();
+        if (image.isNull()) {
+            const bool tooLarge = static_cast<qint64>(size.width()) * size.height() * depth / 8 > INT_MAX;
+            result.errorString = tooLarge
+                                 ? tr("The image is too large to be decoded at once, and its format cannot be decoded in parts")
+                                 : reader.errorString();
+            return result;
+        }
+        result.buffer = store->shouldTile(image.size(), QImage(1, 1, ImageBuffer::formatFor(image)).depth())
+                        ? ImageBuffer(image, store) : ImageBuffer(image);
+        return result;
+    }
+
+    // Decoders start from the top again for each band, so bands are as large as the memory allows
+    const qint64 lineBytes = static_cast<qint64>(storedSize.width()) * 4;
+    const qint64 bandBytes = qMin(store->memoryBudget() / 4, static_cast<qint64>(INT_MAX));
+    const int bandRows = qMax(1, static_cast<int>(bandBytes / lineBytes / TileStore::tileSize)) * TileStore::tileSize;
+    for (int top = 0; top < storedSize.height(); top += bandRows) {
+        QRect band(0, top, storedSize.width(), qMin(bandRows, storedSize.height() - top));
+        QImageReader bandReader(filePath);
+        bandReader.setAutoTransform(false); // the clip rect is in stored coordinates, bands are turned here
+        bandReader.setClipRect(band);
+        QImage pixels = bandReader.read();
+        if (pixels.isNull()) {
+            result.errorString = bandReader.errorString();
+            result.buffer = ImageBuffer();
+            return result;
+        }
+        if (result.buffer.isNull())
+            result.buffer = ImageBuffer(size, ImageBuffer::formatFor(pixels), store);
+        result.buffer.write(transformed(band, storedSize, transformation).topLeft(), transformed(pixels, transformation));
+    }
+    return result;
+}
+
+void ImageWindow::previewDecoded() {
+    if (loaded) return;
+    auto result = previewWatcher.result();
+    if (!result.image.isNull())
+        scene->setPreview(result.image);
+}
+
+void ImageWindow::imageDecoded() {
+    auto result = imageWatcher.result();
+    if (result.buffer.isNull()) {
+        QMessageBox::information(this, QGuiApplication::applicationDisplayName(),
+                                 tr("Cannot load %1: %2").arg(QDir::toNativeSeparators(windowFilePath()), result.errorString));
+        emit fileLoaded(windowFilePath(), false);
+        if (auto *subWindow = qobject_cast<QMdiSubWindow *>(parentWidget())) subWindow->close();
+        else close();
+        return;
+    }
+
+    scene->setBuffer(result.buffer);
+    imageSize = result.buffer.size();
+    loaded = true;
+    emit fileLoaded(windowFilePath(), true);
+}
+
 bool ImageWindow::event(QEvent *event) {
     if (event->type() == QEvent::MouseButtonPress) {
         /*
@@ -172,14 +362,126 @@ void ImageWindow::smartFill() {
     scene->smartFill();
 }
 
+bool ImageWindow::canUndo() const {
+    return scene->canUndo();
+}
+
+bool ImageWindow::canRedo() const {
+    return scene->canRedo();
+}
+
+void ImageWindow::undo() {
+    scene->undo();
+}
+
+void ImageWindow::redo() {
+    scene->redo();
+}
+
 bool ImageWindow::saveFile() {
-    QImageWriter writer(windowFilePath());
+    // A save requested while another one runs goes where the latest request went
+    return saveTo(saving ? requestedPath : windowFilePath());
+}
 
-    if (!writer.write(scene->getImage())) {
+bool ImageWindow::saveTo(const QString &filePath) {
+    if (!loaded) {
         QMessageBox::information(this, QGuiApplication::applicationDisplayName(),
-                                 tr("Cannot write %1: %2").arg(QDir::toNativeSeparators(windowFilePath())),
-                                 writer.errorString());
+                                 tr("Cannot write %1: the image is still being loaded").arg(QDir::toNativeSeparators(filePath)));
         return false;
     }
+    requestedPath = filePath;
+    if (saving) saveRequested = true;
+    else startSave();
     return true;
 }
+
+bool ImageWindow::saveAs() {
+    if (!loaded) return saveFile();
+
+    QStringList patterns;
+    for (const auto &format : QImageWriter::supportedImageFormats())
+        patterns.append("*." + QString::fromLatin1(format));
+    QString projectFilter = tr("Poisson Editor projects (*.%1)").arg(ProjectFile::suffix);
+    QString filters = tr("Images (%1)").arg(patterns.join(' ')) + ";;" + projectFilter;
+    QString selectedFilter = ProjectFile::isProjectFile(windowFilePath()) ? projectFilter : QString();
+
+    auto filePath = QFileDialog::getSaveFileName(this, tr("Save As"), windowFilePath(), filters, &selectedFilter);
+    if (filePath.isEmpty()) return false;
+    if (selectedFilter == projectFilter && !ProjectFile::isProjectFile(filePath))
+        filePath += QString(".") + ProjectFile::suffix;
+    return saveTo(filePath);
+}
+
+void ImageWindow::startSave() {
+    // The snapshot shares its planes with the scene, edits made during the save detach them
+    auto project = scene->toProject();
+    saving = true;
+    savingPath = requestedPath;
+    bytesWritten.storeRelease(0);
+    updateSaveProgress();
+    saveStatusLabel->show();
+    saveProgressBar->show();
+    saveProgressTimer.start();
+    saveWatcher.setFuture(QtConcurrent::run(&ImageWindow::encode, project, savingPath, &bytesWritten));
+}
+
+QString ImageWindow::encode(const ProjectFile::Project &project, const QString &filePath,
+                            QAtomicInteger<qint64> *bytesWritten) {
+    // Encoded into a temporary file, which only replaces the target when everything is written
+    CountingSaveFile file(filePath, bytesWritten);
+    if (!file.open(QIODevice::WriteOnly)) return file.errorString();
+    if (ProjectFile::isProjectFile(filePath)) {
+        QString errorString;
+        if (!ProjectFile::write(&file, project, &errorString)) return errorString;
+    } else {
+        // Images only keep the result, with erased pixels transparent
+        const ImageBuffer &buffer = project.buffer;
+        // Image writers need the whole image, so a tiled buffer is loaded here
+        QImage image = !project.erasedRect.isEmpty() ? buffer.composite(buffer.rect())
+                       : buffer.isTiled() ? buffer.copy(buffer.rect()) : buffer.pixels();
+        QImageWriter writer(&file, QFileInfo(filePath).suffix().toLower().toLatin1());
+        if (!writer.write(image)) return writer.errorString();
+    }
+    if (!file.commit()) return file.errorString();
+    return QString();
+}
+
+void ImageWindow::saveFinished() {
+    if (!saving) return;
+    saving = false;
+    saveProgressTimer.stop();
+    saveStatusLabel->hide();
+    saveProgressBar->hide();
+
+    auto errorString = saveWatcher.result();
+    if (!errorString.isNull()) {
+        QMessageBox::information(this, QGuiApplication::applicationDisplayName(),
+                                 tr("Cannot write %1: %2").arg(QDir::toNativeSeparators(savingPath), errorString));
+        saveRequested = false;
+        emit fileSaved(savingPath, false);
+        return;
+    }
+    setWindowFilePath(savingPath);
+    emit fileSaved(savingPath, true);
+    if (saveRequested) {
+        saveRequested = false;
+        startSave();
+    }
+}
+
+void ImageWindow::updateSaveProgress() {
+    saveStatusLabel->setText(tr("Saving (%1 KB written)").arg(bytesWritten.loadAcquire() / 1024));
+}
+
+void ImageWindow::closeEvent(QCloseEvent *event) {
+    // Finish pending saves, a requested save may start another one
+    if (saving) {
+        QApplication::setOverrideCursor(Qt::WaitCursor);
+        while (saving) {
+            saveWatcher.waitForFinished();
+            saveFinished();
+        }
+        QApplication::restoreOverrideCursor();
+    }
+    event->accept();
+}
@@ -23,6 +23,7 @@ public:
     const QString currentFile() const;
     const QString currentFileName() const;
     bool saveFile();
+    bool saveAs();
 
     void showWithSizeHint(QSize parentSize);
 
@@ -33,25 +34,67 @@ public:
 
     void poissonFusion();
     void smartFill();
+    bool canUndo() const;
+    bool canRedo() const;
+    void undo();
+    void redo();
+
+signals:
+    void fileLoaded(const QString &filePath, bool succeeded);
+    void fileSaved(const QString &filePath, bool succeeded);
+    void historyChanged();
 
 protected:
+    void closeEvent(QCloseEvent *event) override;
     bool event(QEvent *event) override;
     bool gestureEvent(QGestureEvent *event);
     bool nativeGestureEvent(QNativeGestureEvent *event); // macOS-specific
 
 private:
+    // Previews are decoded into `image`, full images into `buffer`
+    struct DecodedImage {
+        QImage image;
+        ImageBuffer buffer;
+        QString errorString;
+    };
+
+    bool loadProject(const QString &filePath);
+    static DecodedImage decode(const QString &filePath, const QSize &scaledSize);
+    static DecodedImage decodeBuffer(const QString &filePath);
+    void previewDecoded();
+    void imageDecoded();
+    // Return the error string, or a null string if succeeded
+    static QString encode(const ProjectFile::Project &project, const QString &filePath,
+                          QAtomicInteger<qint64> *bytesWritten);
+    bool saveTo(const QString &filePath);
+    void startSave();
+    void saveFinished();
+    void updateSaveProgress();
     void setSlider(double scale);
 
     double scale = 1.0;
 
     QSize imageSize;
+    bool loaded = false;
+    QFutureWatcher<DecodedImage> previewWatcher;
+    QFutureWatcher<DecodedImage> imageWatcher;
+
+    bool saving = false;
+    bool saveRequested = false; // saved again after the current save finishes
+    QString requestedPath; // target of the latest requested save
+    QString savingPath; // target of the current save, the window takes it once the save succeeds
+    QFutureWatcher<QString> saveWatcher;
+    QAtomicInteger<qint64> bytesWritten;
+    QTimer saveProgressTimer;
+    QLabel *saveStatusLabel;
+    QProgressBar *saveProgressBar;
+
     bool inGesture = false;
     double scaleBeforeGesture;
     double cumulativeScale;
 
     ImageScene *scene;
     QGraphicsView *view;
-    QPixmap originalImage;
 
     QSlider *zoomSlider;
     QLabel *zoomScaleLabel;
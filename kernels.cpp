@@ -0,0 +1,63 @@
+#include <QtCore>
+
+#include "kernels.h"
+
+namespace Kernels {
+    namespace baseline { const Table &table(); }
+#ifdef POISSONEDITOR_X86_KERNELS
+    namespace avx2 { const Table &table(); }
+    namespace avx512 { const Table &table(); }
+#endif
+
+    // Tables supported by this CPU, best first
+    static QList<const Table *> availableTables() {
+        QList<const Table *> tables;
+#ifdef POISSONEDITOR_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl"))
+            tables.append(&avx512::table());
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+            tables.append(&avx2::table());
+#endif
+        tables.append(&baseline::table());
+        return tables;
+    }
+
+    static const Table *findTable(const QString &isa) {
+        // SSE2 is the baseline of x86-64
+        QString name = isa.compare("sse2", Qt::CaseInsensitive) == 0 ? QString("baseline") : isa;
+        for (const Table *table : availableTables())
+            if (name.compare(table->isa, Qt::CaseInsensitive) == 0) return table;
+        return nullptr;
+    }
+
+    static QAtomicPointer<const Table> selected;
+
+    const Table &table() {
+        const Table *table = selected.loadAcquire();
+        if (table != nullptr) return *table;
+        auto isa = qgetenv("POISSONEDITOR_ISA");
+        if (!isa.isEmpty()) {
+            table = findTable(QString::fromLatin1(isa));
+            if (table == nullptr)
+                qWarning() << "Kernels::table : instruction set" << isa << "is not available, using the default.";
+        }
+        if (table == nullptr) table = availableTables().first();
+        selected.testAndSetOrdered(nullptr, table);
+        return *selected.loadAcquire();
+    }
+
+    QStringList supportedIsas() {
+        QStringList isas;
+        for (const Table *table : availableTables())
+            isas.append(table->isa);
+        return isas;
+    }
+
+    bool selectIsa(const QString &isa) {
+        const Table *table = findTable(isa);
+        if (table == nullptr) return false;
+        selected.storeRelease(table);
+        return true;
+    }
+}
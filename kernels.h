@@ -0,0 +1,66 @@
+#ifndef POISSONEDITOR_KERNELS_H
+#define POISSONEDITOR_KERNELS_H
+
+#include <QString>
+#include <QStringList>
+
+
+// Hot loops compiled once per instruction set, with the best one supported by the CPU
+// chosen at startup. All variants share the source in kernelsimpl.h and give bit-exact
+// results, so the choice only affects speed.
+namespace Kernels {
+
+    // Candidates scored together by maskedSsdRow, each summed in a 32-bit lane
+    const int ssdLanes = 16;
+
+    typedef void (*MaskedSsdRow)(const unsigned char *src, int planeStride, int rowStride, int channels,
+                                 const unsigned char *target, const unsigned char *weight, int size,
+                                 const unsigned char *valid, int begin, int end, int *best, int *bestX);
+
+    struct Table {
+        const char *isa;
+
+        // dst[j] op= src[j] << shift | src[j - 1] >> (8 - shift), for j in [begin, end) and shift < 8
+        void (*bitsAnd)(unsigned char *dst, const unsigned char *src, int begin, int end, int shift);
+        void (*bitsOr)(unsigned char *dst, const unsigned char *src, int begin, int end, int shift);
+        void (*bitsAndNot)(unsigned char *dst, const unsigned char *src, int begin, int end, int shift);
+
+        // Bias of the Poisson equation along a row of one channel, with mixed gradients
+        // Pointers are to rows y - 1, y and y + 1; rows outside the image are null.
+        // A neighbor outside the mask (label 0) adds the center value of `orig` instead.
+        void (*mixedGradientRow)(const int *const orig[3], const int *const patch[3],
+                                 const unsigned char *const mask[3], int width, int *bias);
+
+        // Laplacian of the fusion system applied to each channel of x, for unknowns p in [begin, end)
+        // Channels are planes of `stride` values, x[c * stride + p] is channel c of unknown p, and
+        // y[p] = diagonal[p] * x[p] - x[n0] - x[n1] - x[n2] - x[n3] in each plane, with n0..n3 the
+        // entries neighbors[4 * p .. 4 * p + 3]; missing neighbors index a zero of each plane.
+        void (*poissonStencil)(const float *diagonal, const int *neighbors, int channels, int stride,
+                               const float *x, float *y, int begin, int end);
+
+        // Masked sum of squared differences between a size×size target window and the candidate
+        // windows centered on one row, for centers in [begin, end) whose bit is set in `valid`.
+        // src[ch * planeStride + dy * rowStride + x] is channel ch at column x of window row dy,
+        // and columns [-size, end + ssdLanes + size) must be readable. `target` is planar like
+        // `src`, pixels with a zero `weight` are not compared. `best` and `bestX` are updated
+        // with a candidate that is better, or as good with a smaller x.
+        MaskedSsdRow maskedSsdRow;
+        // The same for the common sizes 7, 9, 11 and 13, in order, with the window loops unrolled
+        MaskedSsdRow maskedSsdRowFixed[4];
+    };
+
+    // Kernels of the selected instruction set
+    const Table &table();
+    // The masked SSD kernel of `table` for windows of `size`
+    inline MaskedSsdRow maskedSsdRow(const Table &table, int size) {
+        return size >= 7 && size <= 13 && size % 2 == 1 ? table.maskedSsdRowFixed[(size - 7) / 2] : table.maskedSsdRow;
+    }
+    // Instruction sets compiled in and supported by this CPU, best first
+    QStringList supportedIsas();
+    // Force an instruction set, for benchmarking or comparing results; must be called at startup
+    // The POISSONEDITOR_ISA environment variable has the same effect.
+    bool selectIsa(const QString &isa);
+
+}
+
+#endif //POISSONEDITOR_KERNELS_H
@@ -0,0 +1,3 @@
+// Kernels for CPUs with AVX2 and FMA, compiled with the flags set in CMakeLists.txt
+#define KERNELS_ISA avx2
+#include "kernelsimpl.h"
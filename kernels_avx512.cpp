@@ -0,0 +1,3 @@
+// Kernels for CPUs with AVX-512 (F, BW and VL), compiled with the flags set in CMakeLists.txt
+#define KERNELS_ISA avx512
+#include "kernelsimpl.h"
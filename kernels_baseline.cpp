@@ -0,0 +1,3 @@
+// Kernels for any CPU of the target architecture (SSE2 on x86-64)
+#define KERNELS_ISA baseline
+#include "kernelsimpl.h"
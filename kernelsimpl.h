@@ -0,0 +1,146 @@
+// Implementation of the kernels in kernels.h, included once per instruction set
+// The including file defines KERNELS_ISA, the name of the namespace for the variant, and
+// is compiled with the matching architecture flags. Kernels must not call inline functions
+// from other headers (Qt, the standard library): those would be compiled with the same
+// flags, and the linker could pick these copies for code that runs on any CPU.
+
+#ifndef KERNELS_ISA
+#error "KERNELS_ISA must be defined before including kernelsimpl.h"
+#endif
+
+#include "kernels.h"
+
+namespace Kernels {
+    namespace KERNELS_ISA {
+
+        static inline unsigned char shiftedByte(const unsigned char *src, int j, int shift) {
+            return static_cast<unsigned char>(src[j] << shift | src[j - 1] >> (8 - shift));
+        }
+
+        static void bitsAnd(unsigned char *dst, const unsigned char *src, int begin, int end, int shift) {
+            for (int j = begin; j < end; ++j)
+                dst[j] &= shiftedByte(src, j, shift);
+        }
+
+        static void bitsOr(unsigned char *dst, const unsigned char *src, int begin, int end, int shift) {
+            for (int j = begin; j < end; ++j)
+                dst[j] |= shiftedByte(src, j, shift);
+        }
+
+        static void bitsAndNot(unsigned char *dst, const unsigned char *src, int begin, int end, int shift) {
+            for (int j = begin; j < end; ++j)
+                dst[j] &= static_cast<unsigned char>(~shiftedByte(src, j, shift));
+        }
+
+        static inline int mixedGradient(int o, int p, int on, int pn, unsigned char label) {
+            int gradOrig = o - on, gradPatch = p - pn;
+            int grad = (gradOrig < 0 ? -gradOrig : gradOrig) > (gradPatch < 0 ? -gradPatch : gradPatch)
+                       ? gradOrig : gradPatch;
+            return label != 0 ? grad : o;
+        }
+
+        static void mixedGradientRow(const int *const orig[3], const int *const patch[3],
+                                     const unsigned char *const mask[3], int width, int *bias) {
+            const int *o = orig[1], *p = patch[1];
+            const unsigned char *label = mask[1];
+            for (int x = 0; x < width; ++x)
+                bias[x] = 0;
+            // Rows above and below
+            for (int k = 0; k < 3; k += 2) {
+                if (orig[k] == nullptr) continue;
+                const int *on = orig[k], *pn = patch[k];
+                const unsigned char *ln = mask[k];
+                for (int x = 0; x < width; ++x)
+                    bias[x] += mixedGradient(o[x], p[x], on[x], pn[x], ln[x]);
+            }
+            // Left and right neighbors
+            for (int x = 1; x < width; ++x)
+                bias[x] += mixedGradient(o[x], p[x], o[x - 1], p[x - 1], label[x - 1]);
+            for (int x = 0; x + 1 < width; ++x)
+                bias[x] += mixedGradient(o[x], p[x], o[x + 1], p[x + 1], label[x + 1]);
+        }
+
+        // A nonzero FixedChannels replaces `channels` by a constant, so that the channel loop is unrolled
+        template <int FixedChannels>
+        static void poissonStencil(const float *diagonal, const int *neighbors, int channelCount, int stride,
+                                   const float *x, float *y, int begin, int end) {
+            const int channels = FixedChannels != 0 ? FixedChannels : channelCount;
+            for (int p = begin; p < end; ++p) {
+                const int *nb = neighbors + 4 * p;
+                for (int c = 0; c < channels; ++c) {
+                    const float *xc = x + c * stride;
+                    y[c * stride + p] = diagonal[p] * xc[p] - xc[nb[0]] - xc[nb[1]] - xc[nb[2]] - xc[nb[3]];
+                }
+            }
+        }
+
+        static void poissonStencil(const float *diagonal, const int *neighbors, int channels, int stride,
+                                   const float *x, float *y, int begin, int end) {
+            if (channels == 3) poissonStencil<3>(diagonal, neighbors, channels, stride, x, y, begin, end);
+            else if (channels == 1) poissonStencil<1>(diagonal, neighbors, channels, stride, x, y, begin, end);
+            else poissonStencil<0>(diagonal, neighbors, channels, stride, x, y, begin, end);
+        }
+
+        // A nonzero FixedSize replaces `size` by a constant, so that the window loops can be unrolled
+        template <int FixedSize>
+        static void maskedSsdRow(const unsigned char *src, int planeStride, int rowStride, int channels,
+                                 const unsigned char *target, const unsigned char *weight, int windowSize,
+                                 const unsigned char *valid, int begin, int end, int *best, int *bestX) {
+            const int size = FixedSize != 0 ? FixedSize : windowSize;
+            const int half = size / 2, validBytes = (end + 7) >> 3;
+            const int invalidCost = 1 << 30; // above any window cost, so invalid lanes never block pruning
+            for (int x0 = begin & ~(ssdLanes - 1); x0 < end; x0 += ssdLanes) {
+                // Blocks without a valid candidate are skipped on their bits alone
+                int byte = x0 >> 3;
+                unsigned int word = valid[byte] | (byte + 1 < validBytes ? valid[byte + 1] << 8 : 0);
+                if (x0 < begin) word &= ~0u << (begin - x0);
+                if (end - x0 < ssdLanes) word &= (1u << (end - x0)) - 1;
+                if (word == 0) continue;
+
+                // Lanes are adjacent candidates. Differences are taken in 16 bits but summed in 32:
+                // a single squared difference (up to 255^2) already fills a 16-bit lane, so 16-bit
+                // partial sums would have to be widened after every pixel anyway. This is the form
+                // compilers map onto multiply-adds of 16-bit pairs into 32-bit lanes.
+                int acc[ssdLanes];
+                for (int l = 0; l < ssdLanes; ++l)
+                    acc[l] = (word >> l & 1) != 0 ? 0 : invalidCost;
+                const unsigned char *base = src + x0 - half;
+                bool pruned = false;
+                for (int dy = 0; dy < size && !pruned; ++dy) {
+                    for (int dx = 0; dx < size; ++dx) {
+                        if (weight[dy * size + dx] == 0) continue;
+                        for (int ch = 0; ch < channels; ++ch) {
+                            const unsigned char *s = base + ch * planeStride + dy * rowStride + dx;
+                            short t = target[(ch * size + dy) * size + dx];
+                            for (int l = 0; l < ssdLanes; ++l) {
+                                int d = static_cast<short>(s[l] - t);
+                                acc[l] += d * d;
+                            }
+                        }
+                    }
+                    // Sums only grow, stop once no lane can beat the best so far
+                    int lowest = acc[0];
+                    for (int l = 1; l < ssdLanes; ++l)
+                        lowest = acc[l] < lowest ? acc[l] : lowest;
+                    pruned = lowest > *best;
+                }
+                if (pruned) continue;
+                for (int l = 0; l < ssdLanes; ++l)
+                    if ((word >> l & 1) != 0 && (acc[l] < *best || (acc[l] == *best && x0 + l < *bestX))) {
+                        *best = acc[l];
+                        *bestX = x0 + l;
+                    }
+            }
+        }
+
+        const Table &table();
+    }
+}
+
+const Kernels::Table &Kernels::KERNELS_ISA::table() {
+#define KERNELS_STRINGIFY_(name) #name
+#define KERNELS_STRINGIFY(name) KERNELS_STRINGIFY_(name)
+    static const Table table = {KERNELS_STRINGIFY(KERNELS_ISA), bitsAnd, bitsOr, bitsAndNot, mixedGradientRow,
+                                 poissonStencil, maskedSsdRow<0>, {maskedSsdRow<7>, maskedSsdRow<9>, maskedSsdRow<11>, maskedSsdRow<13>}};
+    return table;
+}
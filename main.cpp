@@ -1,12 +1,33 @@
+#include <memory>
+
 #include <QApplication>
 #include <QCommandLineParser>
+#include <QSettings>
 
 #include "mainwindow.h"
+#include "benchmark.h"
+#include "fusesequence.h"
+#include "fusionserver.h"
+#include "kernels.h"
+#include "poissonsolver.h"
+
+// Whether the arguments select a mode without windows, which must run without a display
+static bool isHeadless(int argc, char *argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        QByteArray arg(argv[i]);
+        if (arg == "--") break;
+        if (arg == "--benchmark" || arg == "--server" || arg == "--fuse-sequence" ||
+            arg.startsWith("--fuse-sequence="))
+            return true;
+    }
+    return false;
+}
 
 int main(int argc, char *argv[]) {
     Q_INIT_RESOURCE(graphics);
 
-    QApplication app(argc, argv);
+    std::unique_ptr<QCoreApplication> app(isHeadless(argc, argv) ? new QCoreApplication(argc, argv)
+                                                                  : new QApplication(argc, argv));
     QCoreApplication::setApplicationName("Poisson Image Editing");
     QCoreApplication::setOrganizationName("Zecong Hu");
     QCoreApplication::setApplicationVersion(QT_VERSION_STR);
@@ -17,8 +38,38 @@ int main(int argc, char *argv[]) {
     parser.addPositionalArgument("file", "The file to open.");
     parser.addOption({"tile", "Tile windows."});
     parser.addOption({"cascade", "Cascade windows."});
-    parser.process(app);
+    parser.addOption({"isa", "Instruction set of the image kernels, one of: " + Kernels::supportedIsas().join(", ") + ".", "name"});
+    parser.addOption({"solver", "Linear solver of Poisson fusion, auto or one of: " + PoissonSolver::backends().join(", ") + ".", "name"});
+    parser.addOption({"benchmark", "Measure the thresholds of smart fill and the fusion solvers, and exit."});
+    parser.addOption({"fuse-sequence", "Fuse the patch image into each given file, as frames of a sequence, and exit.", "patch"});
+    parser.addOption({"offsets", "With --fuse-sequence, file with the offset \"x y\" of the patch in each frame, one per line.", "file"});
+    parser.addOption({"output", "With --fuse-sequence, directory for the fused frames.", "directory", "fused"});
+    parser.addOption({"server", "Serve fusion and fill jobs on a local socket until stopped."});
+    parser.addOption({"socket", "Name of the local socket of --server.", "name", "poisson-editor"});
+    parser.process(*app);
 
+    if (parser.isSet("isa") && !Kernels::selectIsa(parser.value("isa")))
+        throw std::runtime_error("Instruction set is not supported by this build or CPU");
+    QSettings settings(QCoreApplication::organizationName(), QCoreApplication::applicationName());
+    PoissonSolver::setDirectMaxVars(settings.value("solver/directMaxVars", PoissonSolver::directMaxVars()).toInt());
+    if (!PoissonSolver::selectBackend(parser.isSet("solver") ? parser.value("solver")
+                                                             : settings.value("solver/backend", "auto").toString()))
+        throw std::runtime_error("Unknown solver backend");
+    if (parser.isSet("benchmark")) {
+        Benchmark::measureFftCrossover();
+        Benchmark::measureDirectMaxVars();
+        return 0;
+    }
+    if (parser.isSet("fuse-sequence"))
+        return FuseSequence::run(parser.value("fuse-sequence"), parser.positionalArguments(), parser.value("offsets"),
+                                 parser.value("output"));
+    if (parser.isSet("server")) {
+        FusionServer server;
+        if (!server.listen(parser.value("socket")))
+            throw std::runtime_error("Cannot listen on " + parser.value("socket").toStdString() + ": " +
+                                     server.errorString().toStdString());
+        return app->exec();
+    }
     if (parser.isSet("tile") && parser.isSet("cascade"))
         throw std::runtime_error("Cannot set both tile and cascade flags");
 
@@ -28,5 +79,5 @@ int main(int argc, char *argv[]) {
     mainWindow.show();
     if (parser.isSet("tile")) mainWindow.tileWindows();
     else if (parser.isSet("cascade")) mainWindow.cascadeWindows();
-    return app.exec();
+    return app->exec();
 }
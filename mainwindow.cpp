@@ -59,14 +59,19 @@ bool MainWindow::openFile(const QString &fileName) {
     }
     const bool succeeded = loadFile(fileName);
     if (succeeded)
-        statusBar()->showMessage(tr("File loaded from %1").arg(fileName), 2000);
+        statusBar()->showMessage(tr("Loading %1").arg(fileName));
     return succeeded;
 }
 
 bool MainWindow::loadFile(const QString &fileName) {
     ImageWindow *child = createMdiChild();
+    // Decoding is done in the background, so that many files can be opened at once
     const bool succeeded = child->loadFile(fileName);
     if (succeeded) {
+        connect(child, &ImageWindow::fileLoaded, this, [this](const QString &filePath, bool loaded) {
+            if (loaded) statusBar()->showMessage(tr("File loaded from %1").arg(filePath), 2000);
+            else statusBar()->clearMessage();
+        });
         child->showWithSizeHint(mdiArea->size());
     } else child->close();
     MainWindow::prependToRecentFiles(fileName);
@@ -153,16 +158,25 @@ void MainWindow::cascadeWindows() {
 }
 
 void MainWindow::save() {
-    if (activeMdiChild() && activeMdiChild()->saveFile())
-        statusBar()->showMessage(tr("File saved"), 2000);
+    // Saving is done in the background, the result is reported through ImageWindow::fileSaved
+    if (activeMdiChild() != nullptr)
+        activeMdiChild()->saveFile();
 }
 
 void MainWindow::saveAs() {
-    ImageWindow *child = activeMdiChild();
-//    if (child != nullptr && child->saveAs()) {
-//        statusBar()->showMessage(tr("File saved"), 2000);
-//        MainWindow::prependToRecentFiles(child->currentFile());
-//    }
+    // The file is added to the recent files once it is actually written, see createMdiChild
+    if (activeMdiChild() != nullptr)
+        activeMdiChild()->saveAs();
+}
+
+void MainWindow::undo() {
+    if (activeMdiChild() != nullptr)
+        activeMdiChild()->undo();
+}
+
+void MainWindow::redo() {
+    if (activeMdiChild() != nullptr)
+        activeMdiChild()->redo();
 }
 
 void MainWindow::cut() {
@@ -203,6 +217,8 @@ void MainWindow::updateMenus() {
 //    bool hasLassoSelection = (activeMdiChild() && activeMdiChild()->hasLassoSelection());
 //    cutAct->setEnabled(hasLassoSelection);
 //    copyAct->setEnabled(hasLassoSelection);
+    undoAct->setEnabled(hasMdiChild && activeMdiChild()->canUndo());
+    redoAct->setEnabled(hasMdiChild && activeMdiChild()->canRedo());
     cutAct->setEnabled(hasMdiChild);
     copyAct->setEnabled(hasMdiChild);
 
@@ -252,6 +268,12 @@ void MainWindow::smartFill() {
 ImageWindow *MainWindow::createMdiChild() {
     auto *child = new ImageWindow(this);
     mdiArea->addSubWindow(child);
+    connect(child, &ImageWindow::fileSaved, this, [this](const QString &filePath, bool succeeded) {
+        if (!succeeded) return;
+        statusBar()->showMessage(tr("File saved to %1").arg(filePath), 2000);
+        MainWindow::prependToRecentFiles(filePath);
+    });
+    connect(child, &ImageWindow::historyChanged, this, &MainWindow::updateMenus);
 
     return child;
 }
@@ -318,6 +340,22 @@ void MainWindow::createActions() {
     QToolBar *editToolBar = addToolBar(tr("Edit"));
     editToolBar->setFloatable(false);
 
+    const QIcon undoIcon = QIcon::fromTheme("edit-undo");
+    undoAct = new QAction(undoIcon, tr("&Undo"), this);
+    undoAct->setShortcuts(QKeySequence::Undo);
+    undoAct->setStatusTip(tr("Undo the last operation"));
+    connect(undoAct, &QAction::triggered, this, &MainWindow::undo);
+    editMenu->addAction(undoAct);
+
+    const QIcon redoIcon = QIcon::fromTheme("edit-redo");
+    redoAct = new QAction(redoIcon, tr("&Redo"), this);
+    redoAct->setShortcuts(QKeySequence::Redo);
+    redoAct->setStatusTip(tr("Redo the last undone operation"));
+    connect(redoAct, &QAction::triggered, this, &MainWindow::redo);
+    editMenu->addAction(redoAct);
+
+    editMenu->addSeparator();
+
     const QIcon cutIcon = QIcon::fromTheme("edit-cut", QIcon(":/images/cut.png"));
     cutAct = new QAction(cutIcon, tr("Cu&t"), this);
     cutAct->setShortcuts(QKeySequence::Cut);
@@ -33,6 +33,8 @@ private slots:
     void saveAs();
     void updateRecentFileActions();
     void openRecentFile();
+    void undo();
+    void redo();
     void cut();
     void copy();
     void paste();
@@ -70,6 +72,8 @@ private:
     QAction *recentFileSeparator;
     QAction *recentFileSubMenuAct;
 
+    QAction *undoAct;
+    QAction *redoAct;
     QAction *cutAct;
     QAction *copyAct;
     QAction *pasteAct;
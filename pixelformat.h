@@ -0,0 +1,156 @@
+#ifndef POISSONEDITOR_PIXELFORMAT_H
+#define POISSONEDITOR_PIXELFORMAT_H
+
+#include <cstring>
+#include <utility>
+
+#include <QImage>
+#include <QRgb>
+#if QT_VERSION >= QT_VERSION_CHECK(5, 12, 0)
+#include <QRgba64>
+#endif
+
+
+// Compile-time descriptions of the pixel layouts handled by the image algorithms
+// Each layout provides:
+//   format           the matching QImage format
+//   channels         number of color channels, alpha is ignored
+//   bytesPerPixel
+//   maxValue         maximum value of a channel
+//   shift8           right shift bringing a channel down to 8 bits
+//   load(line, x, c) read the color channels of pixel `x` of a scanline into `c`
+//   store(line, x, c) write the color channels in `c` into pixel `x`, making it opaque
+// Kernels are templates on a layout and instantiated through `dispatch`.
+namespace PixelFormat {
+
+    struct Rgb32Layout {
+        static const int channels = 3;
+        static const int bytesPerPixel = 4;
+        static const int maxValue = 255;
+        static const int shift8 = 0;
+
+        static inline void load(const uchar *line, int x, int *c) {
+            QRgb p = reinterpret_cast<const QRgb *>(line)[x];
+            c[0] = qRed(p), c[1] = qGreen(p), c[2] = qBlue(p);
+        }
+
+        static inline void store(uchar *line, int x, const int *c) {
+            reinterpret_cast<QRgb *>(line)[x] = qRgb(c[0], c[1], c[2]);
+        }
+    };
+
+    struct RGB32 : Rgb32Layout {
+        static const QImage::Format format = QImage::Format_RGB32;
+    };
+
+    struct ARGB32 : Rgb32Layout {
+        static const QImage::Format format = QImage::Format_ARGB32;
+    };
+
+    struct RGB888 {
+        static const QImage::Format format = QImage::Format_RGB888;
+        static const int channels = 3;
+        static const int bytesPerPixel = 3;
+        static const int maxValue = 255;
+        static const int shift8 = 0;
+
+        static inline void load(const uchar *line, int x, int *c) {
+            const uchar *p = line + x * 3;
+            c[0] = p[0], c[1] = p[1], c[2] = p[2];
+        }
+
+        static inline void store(uchar *line, int x, const int *c) {
+            uchar *p = line + x * 3;
+            p[0] = static_cast<uchar>(c[0]), p[1] = static_cast<uchar>(c[1]), p[2] = static_cast<uchar>(c[2]);
+        }
+    };
+
+    struct Grayscale8 {
+        static const QImage::Format format = QImage::Format_Grayscale8;
+        static const int channels = 1;
+        static const int bytesPerPixel = 1;
+        static const int maxValue = 255;
+        static const int shift8 = 0;
+
+        static inline void load(const uchar *line, int x, int *c) {
+            c[0] = line[x];
+        }
+
+        static inline void store(uchar *line, int x, const int *c) {
+            line[x] = static_cast<uchar>(c[0]);
+        }
+    };
+
+#if QT_VERSION >= QT_VERSION_CHECK(5, 12, 0)
+    struct RGBA64 {
+        static const QImage::Format format = QImage::Format_RGBA64;
+        static const int channels = 3;
+        static const int bytesPerPixel = 8;
+        static const int maxValue = 65535;
+        static const int shift8 = 8;
+
+        static inline void load(const uchar *line, int x, int *c) {
+            QRgba64 p = reinterpret_cast<const QRgba64 *>(line)[x];
+            c[0] = p.red(), c[1] = p.green(), c[2] = p.blue();
+        }
+
+        static inline void store(uchar *line, int x, const int *c) {
+            reinterpret_cast<QRgba64 *>(line)[x] = QRgba64::fromRgba64(
+                    static_cast<quint16>(c[0]), static_cast<quint16>(c[1]), static_cast<quint16>(c[2]), 65535);
+        }
+    };
+#endif
+
+    // Channels of pixel `x` reduced to 8 bits
+    template <typename Layout>
+    inline void load8(const uchar *line, int x, int *c) {
+        Layout::load(line, x, c);
+        for (int ch = 0; Layout::shift8 > 0 && ch < Layout::channels; ++ch)
+            c[ch] >>= Layout::shift8;
+    }
+
+    template <typename Layout>
+    inline void copyPixel(uchar *dstLine, int dstX, const uchar *srcLine, int srcX) {
+        memcpy(dstLine + dstX * Layout::bytesPerPixel, srcLine + srcX * Layout::bytesPerPixel, Layout::bytesPerPixel);
+    }
+
+    // Call `Kernel<Layout>::run(args...)` with the layout matching `format`
+    // Return false if the format has no specialized layout.
+    template <template <typename> class Kernel, typename... Args>
+    bool dispatch(QImage::Format format, Args &&... args) {
+        switch (format) {
+            case QImage::Format_RGB32:
+                Kernel<RGB32>::run(std::forward<Args>(args)...);
+                return true;
+            case QImage::Format_ARGB32:
+                Kernel<ARGB32>::run(std::forward<Args>(args)...);
+                return true;
+            case QImage::Format_RGB888:
+                Kernel<RGB888>::run(std::forward<Args>(args)...);
+                return true;
+            case QImage::Format_Grayscale8:
+                Kernel<Grayscale8>::run(std::forward<Args>(args)...);
+                return true;
+#if QT_VERSION >= QT_VERSION_CHECK(5, 12, 0)
+            case QImage::Format_RGBA64:
+                Kernel<RGBA64>::run(std::forward<Args>(args)...);
+                return true;
+#endif
+            default:
+                return false;
+        }
+    }
+
+    template <typename Layout>
+    struct NoKernel {
+        static void run() {}
+    };
+
+    // Whether `format` has a specialized layout; images in other formats are converted up front
+    inline bool supports(QImage::Format format) {
+        return dispatch<NoKernel>(format);
+    }
+
+}
+
+#endif //POISSONEDITOR_PIXELFORMAT_H
@@ -1,134 +1,219 @@
+#include <algorithm>
 #include <functional>
 
 #include "imagemagic.h"
+#include "kernels.h"
+#include "pixelformat.h"
+#include "poissonsolver.h"
 #include "utils.h"
 
 #include <QtCore>
+#include <QPainter>
 
-#include <Eigen/SparseCore>
-#include <Eigen/SparseCholesky>
-#include <Eigen/IterativeLinearSolvers>
+#include <Eigen/Core>
 
 
 typedef float Float;
-typedef Eigen::VectorXf Vector;
-
-QImage ImageMagic::poissonFusion(const QImage &originalImage, const QImage &image, const QImage &mask) {
-    int n = image.size().width(), m = image.size().height();
-    auto isValid = [n, m](int x, int y) {
-        return x >= 0 && x < n && y >= 0 && y < m;
-    };
-
-    qDebug() << "ImageMagic::poissonFusion perf";
-    QElapsedTimer timer;
-    timer.start();
-
-    // Assign variables to interior pixels
-    utils::Matrix<int> index(n, m);
-    std::vector<QPoint> coordinates;
-    /*
-     * 0    -> exterior
-     * >= 1 -> interior
-     */
-    int n_vars = 0;
-    for (int i = 0; i < n; ++i)
-        for (int j = 0; j < m; ++j)
-            if (mask.pixelColor(i, j).value() > 0) {
-                index(i, j) = ++n_vars;
-                coordinates.emplace_back(i, j);
-            }
-    qDebug() << "  1. mark pixels: " << timer.elapsed() << "ms";
-
-    timer.restart();
-    // Create coefficient matrix
-    Eigen::SparseMatrix<Float> A(n_vars, n_vars);
-    std::vector<Eigen::Triplet<Float>> coefficients;
-    // |Np| ƒp  -  ∑{q ∈ Np ∩ Ω} ƒq  =  ∑{q ∈ Np ∩ ∂Ω} ƒ*q  +  ∑{q ∈ Np} v_pq
-    for (int p = 0; p < n_vars; ++p) {
-        int i = coordinates[p].x(), j = coordinates[p].y();
-
-        int neighbors = 4;
-        if (i == 0 || i == n - 1) --neighbors;
-        if (j == 0 || j == m - 1) --neighbors;
-        coefficients.emplace_back(p, p, static_cast<Float>(neighbors));
-
-        for (int d = 0; d < 4; ++d) {
-            int x = i + dir[d][0], y = j + dir[d][1];
-            if (!isValid(x, y)) continue;
-            int q = index(x, y) - 1;
-            if (q >= 0) coefficients.emplace_back(p, q, -1.0);
-        }
+
+using ImageMagic::dir;
+using ImageMagic::FusionSystem;
+
+// Unknowns of a fusion and the prepared solver, which only depend on the mask
+struct ImageMagic::FusionSystem {
+    PoissonSolver::Domain domain;
+    std::unique_ptr<PoissonSolver::Backend> backend;
+    // Solution of the last fusion, the starting guess of the next one in a sequence
+    PoissonSolver::Block solution;
+
+    // `mask` must be Grayscale8
+    explicit FusionSystem(const QImage &mask) : domain(mask) {
+        qDebug() << "ImageMagic::poissonFusion perf";
+        QElapsedTimer timer;
+        timer.start();
+        backend = PoissonSolver::create(PoissonSolver::choose(domain.size));
+        backend->prepare(domain);
+        qDebug() << "  1. prepare" << backend->name() << ":" << timer.elapsed() << "ms";
     }
-    A.setFromTriplets(coefficients.begin(), coefficients.end());
-    qDebug() << "  2. coef matrix: " << timer.elapsed() << "ms";
-
-    Eigen::SimplicialLDLT<decltype(A)> solver(A);
-//    Eigen::ConjugateGradient<decltype(A), Eigen::Upper | Eigen::Lower> solver(A);
-    qDebug() << "  3. eigen compute: " << timer.elapsed() << "ms";
-
-    QImage output = originalImage;
-
-    // Create bias vector for each channel (RGB)
-    std::vector<Vector> bs, xs;
-    for (int ch = 0; ch < 3; ++ch)
-        bs.emplace_back(n_vars);
-    auto color = [](const QImage &img, int x, int y) {
-        return Color(img.pixelColor(x, y));
-    };
-
-    timer.restart();
-    for (int p = 0; p < n_vars; ++p) {
-        int i = coordinates[p].x(), j = coordinates[p].y();
-        auto maskVal = mask.pixelColor(i, j).value();
-        Color val;
-        auto origColor = color(originalImage, i, j);
-        auto patchColor = color(image, i, j);
-        for (int d = 0; d < 4; ++d) {
-            int x = i + dir[d][0], y = j + dir[d][1];
-            if (!isValid(x, y)) continue;
-            auto origNeighborColor = color(originalImage, x, y);
-            auto patchNeighborColor = color(image, x, y);
-//            if (mask.pixel(x, y) != maskVal) {
-            if (mask.pixelColor(x, y).value() == 0) {
-                // border pixel
-                // val += origNeighborColor; + origColor - origNeighborColor;
-                val += origColor;
-//                val += patchNeighborColor + origColor - origNeighborColor;
-            } else {
-                if (mask.pixelColor(x, y).value() != maskVal) {
+};
+
+// `image` must have the same format as `originalImage`, `mask` must be the Grayscale8 mask of `system`
+// Iterative solvers start from the last solution of `system` when `warmStart` is set and there
+// is one, and from the patch otherwise.
+template <typename Layout>
+struct PoissonFusionKernel {
+    static const int channels = Layout::channels;
+
+    static void run(FusionSystem &system, bool warmStart, const QImage &originalImage, const QImage &image,
+                    const QImage &mask, QImage &output, PoissonSolver::Stats &stats) {
+        const PoissonSolver::Domain &domain = system.domain;
+        const int n = domain.n, m = domain.m, n_vars = domain.size;
+        const std::vector<QPoint> &coordinates = domain.coordinates;
+        auto isValid = [n, m](int x, int y) {
+            return x >= 0 && x < n && y >= 0 && y < m;
+        };
+        auto maskValue = [&mask](int x, int y) {
+            return mask.constScanLine(y)[x];
+        };
+        QElapsedTimer timer;
+
+        output = originalImage;
+
+        // Create bias block with a column per channel, a single one for grayscale images
+        PoissonSolver::Block B(n_vars, channels);
+        bool guessPatch = !warmStart || system.solution.cols() != channels;
+        if (guessPatch) system.solution.resize(n_vars, channels);
+
+        // Patches touching each other give no consistent guidance field
+        for (int p = 0; p < n_vars; ++p) {
+            int i = coordinates[p].x(), j = coordinates[p].y();
+            auto maskVal = maskValue(i, j);
+            for (int d = 0; d < 4; ++d) {
+                int x = i + dir[d][0], y = j + dir[d][1];
+                if (isValid(x, y) && maskValue(x, y) != 0 && maskValue(x, y) != maskVal) {
                     qDebug() << "ImageMagic::poissonfusion : Unmasked parts of patches overlap, falling back to naive copy-paste.";
-                    return image;
+                    output = image;
+                    return;
+                }
+            }
+        }
+
+        timer.restart();
+        // Bias is assembled a row at a time by the kernels, from planar channels of the rows
+        // above, at and below; rows are kept in a ring of three slots
+        std::vector<int> origRows(3 * channels * n), patchRows(3 * channels * n), bias(n);
+        auto rowOf = [&](std::vector<int> &rows, int y, int ch) {
+            return rows.data() + ((y % 3) * channels + ch) * n;
+        };
+        auto loadRow = [&](int y) {
+            const uchar *origLine = originalImage.constScanLine(y), *patchLine = image.constScanLine(y);
+            for (int x = 0; x < n; ++x) {
+                int origColor[channels], patchColor[channels];
+                Layout::load(origLine, x, origColor);
+                Layout::load(patchLine, x, patchColor);
+                for (int ch = 0; ch < channels; ++ch) {
+                    rowOf(origRows, y, ch)[x] = origColor[ch];
+                    rowOf(patchRows, y, ch)[x] = patchColor[ch];
                 }
-                for (int ch = 0; ch < 3; ++ch) {
-                    int gradOrig = origColor.col[ch] - origNeighborColor.col[ch];
-                    int gradPatch = patchColor.col[ch] - patchNeighborColor.col[ch];
-                    val.col[ch] += std::abs(gradOrig) > std::abs(gradPatch) ? gradOrig : gradPatch;
+            }
+        };
+        const Kernels::Table &kernels = Kernels::table();
+        if (m > 0) loadRow(0);
+        for (int y = 0; y < m; ++y) {
+            if (y + 1 < m) loadRow(y + 1);
+            const uchar *maskLine = mask.constScanLine(y);
+            if (std::find_if(maskLine, maskLine + n, [](uchar v) { return v != 0; }) == maskLine + n) continue;
+            const uchar *maskRows[3] = {y > 0 ? mask.constScanLine(y - 1) : nullptr, maskLine,
+                                        y + 1 < m ? mask.constScanLine(y + 1) : nullptr};
+            for (int ch = 0; ch < channels; ++ch) {
+                const int *origPtrs[3], *patchPtrs[3];
+                for (int k = 0; k < 3; ++k) {
+                    bool inside = maskRows[k] != nullptr;
+                    origPtrs[k] = inside ? rowOf(origRows, y + k - 1, ch) : nullptr;
+                    patchPtrs[k] = inside ? rowOf(patchRows, y + k - 1, ch) : nullptr;
                 }
+                kernels.mixedGradientRow(origPtrs, patchPtrs, maskRows, n, bias.data());
+                const int *patchRow = rowOf(patchRows, y, ch);
+                for (int x = 0; x < n; ++x)
+                    if (maskLine[x] != 0) {
+                        int p = domain.index(x, y) - 1;
+                        B(p, ch) = bias[x];
+                        if (guessPatch) system.solution(p, ch) = static_cast<Float>(patchRow[x]);
+                    }
             }
         }
-        bs[0][p] = val.col[0];
-        bs[1][p] = val.col[1];
-        bs[2][p] = val.col[2];
+        qDebug() << "  2. bias vectors: " << timer.elapsed() << "ms";
+
+        timer.restart();
+        stats = PoissonSolver::Stats();
+        stats.backend = system.backend->name();
+        stats.unknowns = n_vars;
+        stats.memory = system.backend->memory();
+        system.backend->solve(B, system.solution, stats);
+        const PoissonSolver::Block &X = system.solution;
+        qDebug() << "  3. solve: " << timer.elapsed() << "ms";
+
+        timer.restart();
+        // Assemble solutions into output image
+        for (int i = 0; i < n_vars; ++i) {
+            int color[channels];
+            for (int ch = 0; ch < channels; ++ch)
+                color[ch] = utils::clamp(static_cast<int>(round(X(i, ch))), 0, Layout::maxValue);
+            Layout::store(output.scanLine(coordinates[i].y()), coordinates[i].x(), color);
+        }
+        qDebug() << "  4. output: " << timer.elapsed() << "ms";
+    }
+};
+
+static QImage fuse(FusionSystem &system, bool warmStart, const QImage &originalImage, const QImage &image,
+                   const QImage &grayMask, PoissonSolver::Stats *stats) {
+    auto format = originalImage.format();
+    QImage output;
+    PoissonSolver::Stats solveStats;
+    if (!PixelFormat::dispatch<PoissonFusionKernel>(format, system, warmStart, originalImage,
+                                                    image.convertToFormat(format), grayMask, output, solveStats)) {
+        // Formats without a specialized layout are fused in ARGB32
+        PixelFormat::dispatch<PoissonFusionKernel>(QImage::Format_ARGB32, system, warmStart,
+                                                   originalImage.convertToFormat(QImage::Format_ARGB32),
+                                                   image.convertToFormat(QImage::Format_ARGB32), grayMask, output,
+                                                   solveStats);
+        output = output.convertToFormat(format);
     }
-    qDebug() << "  4. bias vectors: " << timer.elapsed() << "ms";
+    qDebug() << "ImageMagic::poissonFusion :" << system.domain.size << "pixels," << solveStats.backend << "with"
+             << solveStats.unknowns << "unknowns,"
+             << solveStats.iterations << "iterations, residual" << solveStats.residual << ","
+             << solveStats.memory / 1024 << "KB";
+    if (stats != nullptr) *stats = solveStats;
+    return output;
+}
 
-    timer.restart();
-    for (int ch = 0; ch < 3; ++ch) {
-        auto x = solver.solve(bs[ch]);
-        xs.emplace_back(x);
+QImage ImageMagic::poissonFusion(const QImage &originalImage, const QImage &image, const QImage &mask,
+                                 PoissonSolver::Stats *stats) {
+    auto grayMask = mask.convertToFormat(QImage::Format_Grayscale8);
+    FusionSystem system(grayMask);
+    return fuse(system, false, originalImage, image, grayMask, stats);
+}
+
+ImageMagic::SequenceFusion::SequenceFusion(const QImage &patch)
+        : patch(patch.convertToFormat(QImage::Format_ARGB32)), mask(patch.size(), QImage::Format_Grayscale8) {
+    for (int y = 0; y < mask.height(); ++y) {
+        auto *line = reinterpret_cast<const QRgb *>(this->patch.constScanLine(y));
+        uchar *maskLine = mask.scanLine(y);
+        for (int x = 0; x < mask.width(); ++x)
+            maskLine[x] = static_cast<uchar>(qAlpha(line[x]) > 0 ? 1 : 0);
     }
-    qDebug() << "  5. eigen solve: " << timer.elapsed() << "ms";
-
-    timer.restart();
-    // Assemble solutions into output image
-    for (int i = 0; i < n_vars; ++i) {
-        int channels[3];
-        for (int ch = 0; ch < 3; ++ch)
-            channels[ch] = utils::clamp(static_cast<int>(round(xs[ch][i])), 0, 255);
-        QColor col(channels[0], channels[1], channels[2]);
-        output.setPixelColor(coordinates[i], col);
+}
+
+ImageMagic::SequenceFusion::~SequenceFusion() = default;
+
+QImage ImageMagic::SequenceFusion::fuse(const QImage &frame, const QPoint &offset, PoissonSolver::Stats *stats) {
+    // Only the patch and a margin around it take part in the fusion, as in the editor
+    const int margin = 2;
+    QRect patchRect(offset, patch.size());
+    auto roi = patchRect.adjusted(-margin, -margin, margin, margin).intersected(frame.rect());
+    if (!patchRect.intersects(frame.rect())) return frame;
+    QPoint position = offset - roi.topLeft();
+
+    QImage roiMask(roi.size(), QImage::Format_Grayscale8);
+    roiMask.fill(0);
+    auto maskRect = QRect(-position, roi.size()).intersected(mask.rect());
+    utils::copyRect(roiMask, maskRect.topLeft() + position, mask, maskRect);
+
+    // A tracked patch rarely clips the same way for long, keep a few systems only
+    const size_t maxSystems = 8;
+    auto key = std::make_tuple(roi.width(), roi.height(), position.x(), position.y());
+    auto it = systems.find(key);
+    if (it == systems.end()) {
+        if (systems.size() >= maxSystems) systems.clear();
+        it = systems.emplace(key, std::unique_ptr<FusionSystem>(new FusionSystem(roiMask))).first;
     }
-    qDebug() << "  6. output: " << timer.elapsed() << "ms";
 
+    // Frames without a specialized layout, indexed ones included, are fused and returned in ARGB32:
+    // the fused region of an indexed frame would come back with a color table of its own
+    QImage output = PixelFormat::supports(frame.format()) ? frame : frame.convertToFormat(QImage::Format_ARGB32);
+    QImage original = output.copy(roi), image = original.convertToFormat(QImage::Format_ARGB32);
+    QPainter painter(&image);
+    painter.drawImage(position, patch);
+    painter.end();
+    utils::copyRect(output, roi.topLeft(), ::fuse(*it->second, true, original, image, roiMask, stats));
     return output;
 }
@@ -0,0 +1,410 @@
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <tuple>
+
+#include <QtCore>
+
+#include <Eigen/SparseCore>
+#include <Eigen/SparseCholesky>
+
+#include "imagemagic.h"
+#include "kernels.h"
+#include "poissonsolver.h"
+
+using ImageMagic::dir;
+
+PoissonSolver::Domain::Domain(const QImage &mask) : n(mask.width()), m(mask.height()), index(n, m) {
+    for (int i = 0; i < n; ++i)
+        for (int j = 0; j < m; ++j)
+            if (mask.constScanLine(j)[i] > 0) {
+                index(i, j) = ++size;
+                coordinates.emplace_back(i, j);
+            }
+
+    // |Np| ƒp  -  ∑{q ∈ Np ∩ Ω} ƒq  =  ∑{q ∈ Np ∩ ∂Ω} ƒ*q  +  ∑{q ∈ Np} v_pq
+    diagonal.resize(static_cast<size_t>(size));
+    neighbors.assign(4 * static_cast<size_t>(size), size);
+    for (int p = 0; p < size; ++p) {
+        int i = coordinates[p].x(), j = coordinates[p].y();
+        int count = 4;
+        if (i == 0 || i == n - 1) --count;
+        if (j == 0 || j == m - 1) --count;
+        diagonal[p] = static_cast<float>(count);
+        for (int d = 0; d < 4; ++d) {
+            int x = i + dir[d][0], y = j + dir[d][1];
+            if (x < 0 || x >= n || y < 0 || y >= m) continue;
+            int q = index(x, y) - 1;
+            if (q >= 0) neighbors[4 * p + d] = q;
+        }
+    }
+}
+
+namespace PoissonSolver {
+
+    typedef Eigen::SimplicialLDLT<Eigen::SparseMatrix<float>> Ldlt;
+
+    // A X, through planes of the channels padded with a zero for missing neighbors
+    static Block apply(const Domain &domain, const Block &X) {
+        const int channels = static_cast<int>(X.cols()), stride = domain.size + 1;
+        Block planes = Block::Zero(channels, stride), AX(channels, stride);
+        planes.leftCols(domain.size) = X.transpose();
+        Kernels::table().poissonStencil(domain.diagonal.data(), domain.neighbors.data(), channels, stride,
+                                        planes.data(), AX.data(), 0, domain.size);
+        return AX.leftCols(domain.size).transpose();
+    }
+
+    // Largest |B - A X| / |B| over the channels
+    static double relativeResidual(const Domain &domain, const Block &B, const Block &X) {
+        Block R = B - apply(domain, X);
+        double worst = 0;
+        for (int c = 0; c < B.cols(); ++c) {
+            double residual = R.col(c).cast<double>().squaredNorm(), norm = B.col(c).cast<double>().squaredNorm();
+            worst = std::max(worst, norm > 0 ? std::sqrt(residual / norm) : std::sqrt(residual));
+        }
+        return worst;
+    }
+
+    static Eigen::SparseMatrix<float> laplacian(const Domain &domain) {
+        Eigen::SparseMatrix<float> A(domain.size, domain.size);
+        std::vector<Eigen::Triplet<float>> coefficients;
+        coefficients.reserve(5 * static_cast<size_t>(domain.size));
+        for (int p = 0; p < domain.size; ++p) {
+            coefficients.emplace_back(p, p, domain.diagonal[p]);
+            for (int d = 0; d < 4; ++d) {
+                int q = domain.neighbors[4 * p + d];
+                if (q < domain.size) coefficients.emplace_back(p, q, -1.0f);
+            }
+        }
+        A.setFromTriplets(coefficients.begin(), coefficients.end());
+        return A;
+    }
+
+    // Solve with all columns of B in one pass over the factor for each triangular solve, where
+    // the solver of Eigen goes over the factor once per column
+    static Block solveBlock(const Ldlt &solver, const Block &B) {
+        const auto &L = solver.matrixL().nestedExpression();
+        const auto &D = solver.vectorD();
+        const int size = static_cast<int>(B.rows()), channels = static_cast<int>(B.cols());
+        Block Y = solver.permutationP().size() > 0 ? Block(solver.permutationP() * B) : B;
+        float *y = Y.data();
+        // L is unit lower triangular with its strict lower part stored by columns
+        for (int j = 0; j < size; ++j)
+            for (Eigen::SparseMatrix<float>::InnerIterator it(L, j); it; ++it) {
+                float *yi = y + it.index() * channels;
+                const float *yj = y + j * channels;
+                for (int c = 0; c < channels; ++c)
+                    yi[c] -= it.value() * yj[c];
+            }
+        for (int j = 0; j < size; ++j)
+            for (int c = 0; c < channels; ++c)
+                y[j * channels + c] /= D[j];
+        for (int j = size - 1; j >= 0; --j)
+            for (Eigen::SparseMatrix<float>::InnerIterator it(L, j); it; ++it) {
+                const float *yi = y + it.index() * channels;
+                float *yj = y + j * channels;
+                for (int c = 0; c < channels; ++c)
+                    yj[c] -= it.value() * yi[c];
+            }
+        return solver.permutationP().size() > 0 ? Block(solver.permutationPinv() * Y) : Y;
+    }
+
+    // Sparse LDLT factorization, exact and fast for small domains, with memory growing faster
+    // than the number of unknowns
+    class LdltBackend : public Backend {
+        const Domain *domain = nullptr;
+        Ldlt solver;
+
+    public:
+        QString name() const override {
+            return "ldlt";
+        }
+
+        void prepare(const Domain &domain) override {
+            this->domain = &domain;
+            solver.compute(laplacian(domain));
+        }
+
+        void solve(const Block &B, Block &X, Stats &stats) const override {
+            X = solveBlock(solver, B);
+            stats.residual = relativeResidual(*domain, B, X);
+        }
+
+        size_t memory() const override {
+            auto nonZeros = static_cast<size_t>(solver.matrixL().nestedExpression().nonZeros());
+            return nonZeros * (sizeof(float) + sizeof(int)) + static_cast<size_t>(domain->size) *
+                   (sizeof(float) + 3 * sizeof(int));
+        }
+    };
+
+    // Conjugate gradients with a Jacobi preconditioner, applying the Laplacian by its stencil
+    // without storing the matrix; memory is linear in the unknowns, time depends on the
+    // starting guess
+    class ConjugateGradientBackend : public Backend {
+        const Domain *domain = nullptr;
+        static constexpr double tolerance = 1e-6;
+        static const int maxIterations = 10000;
+        static const int maxChannels = 4;
+
+        // The channels are iterated together, each with its own step sizes, and stop being
+        // updated once converged. Each channel is a plane of the vectors, padded with a zero for
+        // missing neighbors. A nonzero FixedChannels replaces the channel count by a constant.
+        template <int FixedChannels>
+        void iterate(const Block &B, Block &X, Stats &stats) const {
+            const int size = domain->size, stride = size + 1;
+            const int channels = FixedChannels != 0 ? FixedChannels : static_cast<int>(B.cols());
+            const float *diagonal = domain->diagonal.data();
+            const Kernels::Table &kernels = Kernels::table();
+            auto apply = [&](const Block &u, Block &v) {
+                kernels.poissonStencil(diagonal, domain->neighbors.data(), channels, stride, u.data(), v.data(), 0, size);
+            };
+            auto dot = [size](const float *u, const float *v) {
+                double sum = 0;
+                for (int i = 0; i < size; ++i)
+                    sum += static_cast<double>(u[i]) * v[i];
+                return sum;
+            };
+
+            Block x = Block::Zero(channels, stride), r = Block::Zero(channels, stride);
+            Block z = Block::Zero(channels, stride), p = Block::Zero(channels, stride), q(channels, stride);
+            x.leftCols(size) = X.transpose();
+            apply(x, q);
+            double rz[maxChannels], rr[maxChannels], threshold[maxChannels];
+            bool active[maxChannels], any = false;
+            for (int c = 0; c < channels; ++c) {
+                float *rc = r.row(c).data(), *zc = z.row(c).data(), *pc = p.row(c).data();
+                const float *qc = q.row(c).data();
+                double norm = 0;
+                for (int i = 0; i < size; ++i) {
+                    rc[i] = B(i, c) - qc[i];
+                    zc[i] = rc[i] / diagonal[i];
+                    pc[i] = zc[i];
+                    norm += static_cast<double>(B(i, c)) * B(i, c);
+                }
+                rz[c] = dot(rc, zc);
+                rr[c] = dot(rc, rc);
+                threshold[c] = tolerance * tolerance * (norm > 0 ? norm : 1);
+                active[c] = rr[c] > threshold[c];
+                any = any || active[c];
+            }
+            int iterations = 0;
+            for (; iterations < maxIterations && any; ++iterations) {
+                // One pass of the stencil for all channels, then the vector updates of each
+                apply(p, q);
+                any = false;
+                for (int c = 0; c < channels; ++c) {
+                    if (!active[c]) continue;
+                    float *xc = x.row(c).data(), *rc = r.row(c).data(), *zc = z.row(c).data(), *pc = p.row(c).data();
+                    const float *qc = q.row(c).data();
+                    double pq = dot(pc, qc);
+                    if (pq <= 0) {
+                        active[c] = false;
+                        continue;
+                    }
+                    auto alpha = static_cast<float>(rz[c] / pq);
+                    for (int i = 0; i < size; ++i) {
+                        xc[i] += alpha * pc[i];
+                        rc[i] -= alpha * qc[i];
+                        zc[i] = rc[i] / diagonal[i];
+                    }
+                    double rzNext = dot(rc, zc);
+                    auto beta = static_cast<float>(rzNext / rz[c]);
+                    rz[c] = rzNext;
+                    rr[c] = dot(rc, rc);
+                    for (int i = 0; i < size; ++i)
+                        pc[i] = zc[i] + beta * pc[i];
+                    active[c] = rr[c] > threshold[c];
+                    any = any || active[c];
+                }
+            }
+            X = x.leftCols(size).transpose();
+            stats.iterations = iterations;
+            stats.residual = relativeResidual(*domain, B, X);
+            stats.memory += 5 * static_cast<size_t>(channels) * stride * sizeof(float);
+        }
+
+    public:
+        QString name() const override {
+            return "cg";
+        }
+
+        void prepare(const Domain &domain) override {
+            this->domain = &domain;
+        }
+
+        void solve(const Block &B, Block &X, Stats &stats) const override {
+            assert(B.cols() <= maxChannels);
+            if (B.cols() == 3) iterate<3>(B, X, stats);
+            else if (B.cols() == 1) iterate<1>(B, X, stats);
+            else iterate<0>(B, X, stats);
+        }
+
+        size_t memory() const override {
+            // The vectors of a solve are added to its stats
+            return static_cast<size_t>(domain->size) * (sizeof(float) + 5 * sizeof(int));
+        }
+    };
+
+    // Reduced solve after Agarwala, "Efficient gradient-domain compositing using quadtrees" (2007)
+    // The correction from the starting guess to the solution is smooth away from the border of
+    // the domain, so it is only kept at the corners of quadtree cells, fine near the border and
+    // up to maxCell pixels wide inside, and interpolated bilinearly in between. The Galerkin
+    // projection of the system onto the corners is solved directly. The quadtree only depends
+    // on the domain; where the guidance field differs a lot from the guess inside the domain,
+    // the interpolated correction is approximate, which shows in the residual.
+    class QuadtreeBackend : public Backend {
+        const Domain *domain = nullptr;
+        static const int maxCell = 32;
+        int nodes = 0;
+        // Solution of the domain from the corners
+        Eigen::SparseMatrix<float> prolongation;
+        Ldlt solver;
+
+    public:
+        QString name() const override {
+            return "quadtree";
+        }
+
+        void prepare(const Domain &domain) override {
+            this->domain = &domain;
+            const int n = domain.n, m = domain.m;
+            // Pixels outside the domain or next to its border, summed over rectangles so that
+            // cells without any can be found in constant time
+            utils::Matrix<int> borderSums(n + 1, m + 1);
+            for (int y = 0; y < m; ++y)
+                for (int x = 0; x < n; ++x) {
+                    int p = domain.index(x, y) - 1;
+                    bool border = p < 0 || domain.diagonal[p] < 4;
+                    for (int d = 0; d < 4 && !border; ++d)
+                        border = domain.neighbors[4 * p + d] == domain.size;
+                    borderSums(x + 1, y + 1) = borderSums(x, y + 1) + borderSums(x + 1, y) - borderSums(x, y) +
+                                               static_cast<int>(border);
+                }
+            // Pixels [x0, x1] × [y0, y1], clipped to the image, contain no border pixel
+            auto interior = [&](int x0, int y0, int x1, int y1) {
+                if (x1 >= n || y1 >= m) return false;
+                return borderSums(x1 + 1, y1 + 1) - borderSums(x0, y1 + 1) - borderSums(x1 + 1, y0) +
+                       borderSums(x0, y0) == 0;
+            };
+
+            // Cells cover the pixels [x0, x0 + size]² with their corners in the domain as nodes;
+            // other pixels of coarse cells remember their cell
+            utils::Matrix<int> node(n, m);
+            std::vector<std::tuple<int, int, int>> cells;
+            utils::Matrix<int> cellOf(n, m);
+            int root = 1;
+            while (root < std::max(n, m) - 1) root *= 2;
+            std::function<void(int, int, int)> subdivide = [&](int x0, int y0, int size) {
+                if (x0 >= n || y0 >= m) return;
+                if (size > 1 && (size > maxCell || !interior(x0, y0, x0 + size, y0 + size))) {
+                    int half = size / 2;
+                    for (int k = 0; k < 4; ++k)
+                        subdivide(x0 + (k & 1) * half, y0 + (k >> 1) * half, half);
+                    return;
+                }
+                for (int k = 0; k < 4; ++k) {
+                    int x = x0 + (k & 1) * size, y = y0 + (k >> 1) * size;
+                    if (x < n && y < m && domain.index(x, y) > 0 && node(x, y) == 0) node(x, y) = ++nodes;
+                }
+                if (size == 1) return;
+                cells.emplace_back(x0, y0, size);
+                for (int y = y0; y <= y0 + size; ++y)
+                    for (int x = x0; x <= x0 + size; ++x)
+                        cellOf(x, y) = static_cast<int>(cells.size());
+            };
+            subdivide(0, 0, std::max(root, 1));
+
+            std::vector<Eigen::Triplet<float>> weights;
+            for (int p = 0; p < domain.size; ++p) {
+                int x = domain.coordinates[p].x(), y = domain.coordinates[p].y();
+                if (node(x, y) > 0) {
+                    weights.emplace_back(p, node(x, y) - 1, 1.0f);
+                    continue;
+                }
+                int x0, y0, size;
+                std::tie(x0, y0, size) = cells[cellOf(x, y) - 1];
+                float fx = static_cast<float>(x - x0) / size, fy = static_cast<float>(y - y0) / size;
+                weights.emplace_back(p, node(x0, y0) - 1, (1 - fx) * (1 - fy));
+                weights.emplace_back(p, node(x0 + size, y0) - 1, fx * (1 - fy));
+                weights.emplace_back(p, node(x0, y0 + size) - 1, (1 - fx) * fy);
+                weights.emplace_back(p, node(x0 + size, y0 + size) - 1, fx * fy);
+            }
+            prolongation.resize(domain.size, nodes);
+            prolongation.setFromTriplets(weights.begin(), weights.end());
+
+            Eigen::SparseMatrix<float> A = laplacian(domain);
+            Eigen::SparseMatrix<float> reduced = prolongation.transpose() * A * prolongation;
+            solver.compute(reduced);
+        }
+
+        void solve(const Block &B, Block &X, Stats &stats) const override {
+            Block correction = solveBlock(solver, prolongation.transpose() * (B - apply(*domain, X)));
+            X += prolongation * correction;
+            stats.unknowns = nodes;
+            stats.residual = relativeResidual(*domain, B, X);
+        }
+
+        size_t memory() const override {
+            auto nonZeros = static_cast<size_t>(prolongation.nonZeros() + solver.matrixL().nestedExpression().nonZeros());
+            return nonZeros * (sizeof(float) + sizeof(int)) + static_cast<size_t>(nodes) * (sizeof(float) + 3 * sizeof(int));
+        }
+    };
+
+    struct Registration {
+        const char *name;
+        std::function<Backend *()> create;
+    };
+
+    static const std::vector<Registration> &registry() {
+        static const std::vector<Registration> registrations = {
+                {"ldlt", []() -> Backend * { return new LdltBackend; }},
+                {"cg",   []() -> Backend * { return new ConjugateGradientBackend; }},
+                {"quadtree", []() -> Backend * { return new QuadtreeBackend; }},
+        };
+        return registrations;
+    }
+
+    static QString selected = "auto";
+    static int directMaxVarsValue = 250000;
+
+    QStringList backends() {
+        QStringList names;
+        for (const auto &registration : registry())
+            names.append(registration.name);
+        return names;
+    }
+
+    std::unique_ptr<Backend> create(const QString &name) {
+        for (const auto &registration : registry())
+            if (name.compare(registration.name, Qt::CaseInsensitive) == 0)
+                return std::unique_ptr<Backend>(registration.create());
+        return nullptr;
+    }
+
+    QString choose(int size) {
+        if (selected != "auto") return selected;
+        return size <= directMaxVarsValue ? "ldlt" : "cg";
+    }
+
+    bool selectBackend(const QString &name) {
+        if (name.compare("auto", Qt::CaseInsensitive) == 0) {
+            selected = "auto";
+            return true;
+        }
+        if (!backends().contains(name, Qt::CaseInsensitive)) return false;
+        selected = name.toLower();
+        return true;
+    }
+
+    QString selectedBackend() {
+        return selected;
+    }
+
+    int directMaxVars() {
+        return directMaxVarsValue;
+    }
+
+    void setDirectMaxVars(int size) {
+        directMaxVarsValue = size;
+    }
+}
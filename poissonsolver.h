@@ -0,0 +1,82 @@
+#ifndef POISSONEDITOR_POISSONSOLVER_H
+#define POISSONEDITOR_POISSONSOLVER_H
+
+#include <memory>
+#include <vector>
+
+#include <QImage>
+#include <QPoint>
+#include <QString>
+#include <QStringList>
+
+#include <Eigen/Core>
+
+#include "utils.h"
+
+
+// Linear solvers for the Poisson equation of a fusion, chosen by name or by problem size
+namespace PoissonSolver {
+
+    // Unknowns by channels, with the channels of an unknown next to each other
+    typedef Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> Block;
+
+    // Unknowns of a fusion, the pixels inside the mask, and the 5-point Laplacian over them
+    struct Domain {
+        int n, m, size = 0;
+        // Unknown of each pixel plus one, 0 outside the mask
+        utils::Matrix<int> index;
+        std::vector<QPoint> coordinates;
+        // Row p of the matrix is diagonal[p] on the diagonal and -1 for each unknown among
+        // neighbors[4 * p .. 4 * p + 3]; missing neighbors are `size`
+        std::vector<float> diagonal;
+        std::vector<int> neighbors;
+
+        // `mask` must be Grayscale8, pixels with a nonzero value are unknown
+        explicit Domain(const QImage &mask);
+    };
+
+    // Statistics of the solves of a fusion
+    struct Stats {
+        QString backend;
+        // Unknowns of the system actually solved
+        int unknowns = 0;
+        // Largest over the channels, which iterative solvers run together; 0 for direct solvers
+        int iterations = 0;
+        // Largest relative residual |b - Ax| / |b| over the channels
+        double residual = 0;
+        // Bytes held by the backend for the domain
+        size_t memory = 0;
+    };
+
+    class Backend {
+    public:
+        virtual ~Backend() = default;
+
+        virtual QString name() const = 0;
+        // Set up for a domain, which must outlive the backend
+        virtual void prepare(const Domain &domain) = 0;
+        // Solve A X = B for all channels at once, X holds the starting guess of iterative
+        // backends on entry
+        virtual void solve(const Block &B, Block &X, Stats &stats) const = 0;
+        virtual size_t memory() const = 0;
+    };
+
+    // Names of the registered backends
+    QStringList backends();
+    // A registered backend, or null for an unknown name
+    std::unique_ptr<Backend> create(const QString &name);
+    // Backend used for a domain of `size` unknowns: the selected one, or with "auto" the direct
+    // solver up to directMaxVars unknowns and the iterative one beyond. The approximate
+    // "quadtree" backend is only used when selected.
+    QString choose(int size);
+
+    // Force a backend, or "auto"; must be called at startup
+    bool selectBackend(const QString &name);
+    QString selectedBackend();
+    // Largest domain solved directly by "auto", calibrated by --benchmark
+    int directMaxVars();
+    void setDirectMaxVars(int size);
+
+}
+
+#endif //POISSONEDITOR_POISSONSOLVER_H
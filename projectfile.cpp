@@ -0,0 +1,170 @@
+#include "projectfile.h"
+
+namespace ProjectFile {
+    const char *const suffix = "pep";
+
+    static const quint32 magic = 0x50455046; // "PEPF"
+    static const quint32 version = 1;
+
+    struct Header {
+        quint32 format, width, height, bytesPerLine;
+        qint64 pixelsOffset, alphaOffset, sceneOffset;
+    };
+
+    static inline qint64 aligned(qint64 offset) {
+        return (offset + sectionAlignment - 1) / sectionAlignment * sectionAlignment;
+    }
+
+    static bool writePadding(QIODevice *device, qint64 offset) {
+        QByteArray zeros(static_cast<int>(offset - device->pos()), '\0');
+        return device->write(zeros) == zeros.size();
+    }
+
+    static void unmapFile(void *file) {
+        delete static_cast<QFile *>(file); // also removes the mapping
+    }
+
+    bool isProjectFile(const QString &filePath) {
+        return QFileInfo(filePath).suffix().compare(suffix, Qt::CaseInsensitive) == 0;
+    }
+
+    bool write(QIODevice *device, const Project &project, QString *errorString) {
+        const ImageBuffer &buffer = project.buffer;
+        const int width = buffer.size().width(), height = buffer.size().height();
+        const qint64 lineBytes = QImage(width, 1, buffer.format()).bytesPerLine();
+        const qint64 alphaLineBytes = BitMatrix(width, 1).rows();
+        const qint64 alphaBytes = alphaLineBytes * height;
+
+        Header header;
+        header.format = static_cast<quint32>(buffer.format());
+        header.width = static_cast<quint32>(width);
+        header.height = static_cast<quint32>(height);
+        header.bytesPerLine = static_cast<quint32>(lineBytes);
+        header.pixelsOffset = sectionAlignment;
+        header.alphaOffset = aligned(header.pixelsOffset + lineBytes * height);
+        header.sceneOffset = aligned(header.alphaOffset + alphaBytes);
+
+        QDataStream out(device);
+        out.setVersion(QDataStream::Qt_5_0);
+        out << magic << version << header.format << header.width << header.height << header.bytesPerLine
+            << header.pixelsOffset << header.alphaOffset << header.sceneOffset;
+
+        bool succeeded = out.status() == QDataStream::Ok && writePadding(device, header.pixelsOffset);
+        // Written in bands of rows, so that tiled buffers are never loaded as a whole
+        const int bandRows = TileStore::tileSize;
+        for (int top = 0; succeeded && top < height; top += bandRows) {
+            QImage band = buffer.isTiled() ? buffer.copy(QRect(0, top, width, qMin(bandRows, height - top))) : buffer.pixels();
+            int first = buffer.isTiled() ? 0 : top;
+            for (int y = 0; succeeded && y < qMin(bandRows, height - top); ++y)
+                succeeded = device->write(reinterpret_cast<const char *>(band.constScanLine(first + y)), lineBytes) == lineBytes;
+        }
+        succeeded = succeeded && writePadding(device, header.alphaOffset);
+        if (!buffer.isTiled()) {
+            succeeded = succeeded && device->write(reinterpret_cast<const char *>(buffer.alpha().toBytes()), alphaBytes) == alphaBytes;
+        } else {
+            // Rows of the alpha plane are contiguous, so bands can be written one after another
+            for (int top = 0; succeeded && top < height; top += bandRows) {
+                BitMatrix band = buffer.copyAlpha(QRect(0, top, width, qMin(bandRows, height - top)));
+                const qint64 bytes = alphaLineBytes * band.cols();
+                succeeded = device->write(reinterpret_cast<const char *>(band.toBytes()), bytes) == bytes;
+            }
+        }
+        succeeded = succeeded && writePadding(device, header.sceneOffset);
+        if (succeeded) {
+            out << project.erasedRect << project.lassoPath << static_cast<quint32>(project.patches.size());
+            for (const auto &patch : project.patches)
+                out << patch.image << patch.pos << patch.zValue;
+            succeeded = out.status() == QDataStream::Ok;
+        }
+        if (!succeeded && errorString != nullptr)
+            *errorString = device->errorString();
+        return succeeded;
+    }
+
+    bool read(const QString &filePath, Project &project, QString *errorString) {
+        auto fail = [&](const QString &message) {
+            if (errorString != nullptr) *errorString = message;
+            return false;
+        };
+
+        // Owned by the pixels if they are mapped
+        std::unique_ptr<QFile> file(new QFile(filePath));
+        if (!file->open(QIODevice::ReadOnly)) return fail(file->errorString());
+
+        QDataStream in(file.get());
+        in.setVersion(QDataStream::Qt_5_0);
+        quint32 fileMagic, fileVersion;
+        Header header;
+        in >> fileMagic >> fileVersion >> header.format >> header.width >> header.height >> header.bytesPerLine
+           >> header.pixelsOffset >> header.alphaOffset >> header.sceneOffset;
+        if (in.status() != QDataStream::Ok || fileMagic != magic)
+            return fail(QCoreApplication::translate("ProjectFile", "Not a project file"));
+        if (fileVersion != version)
+            return fail(QCoreApplication::translate("ProjectFile", "Unsupported project file version %1").arg(fileVersion));
+
+        const int width = static_cast<int>(header.width), height = static_cast<int>(header.height);
+        const auto format = static_cast<QImage::Format>(header.format);
+        const qint64 lineBytes = header.bytesPerLine;
+        const bool knownFormat = format == ImageBuffer::colorFormat || format == ImageBuffer::grayFormat
+                                 || format == ImageBuffer::alphaFormat;
+        if (width <= 0 || height <= 0 || !knownFormat
+            || lineBytes < static_cast<qint64>(width) * QImage(1, 1, format).depth() / 8)
+            return fail(QCoreApplication::translate("ProjectFile", "Corrupted project file"));
+        const qint64 alphaLineBytes = BitMatrix(width, 1).rows();
+        const qint64 alphaBytes = alphaLineBytes * height;
+        if (header.pixelsOffset < in.device()->pos()
+            || header.alphaOffset < header.pixelsOffset + lineBytes * height
+            || header.sceneOffset < header.alphaOffset + alphaBytes || file->size() < header.sceneOffset)
+            return fail(QCoreApplication::translate("ProjectFile", "Corrupted project file"));
+
+        if (!file->seek(header.sceneOffset)) return fail(file->errorString());
+        quint32 patchCount;
+        in >> project.erasedRect >> project.lassoPath >> patchCount;
+        project.patches.clear();
+        for (quint32 i = 0; i < patchCount && in.status() == QDataStream::Ok; ++i) {
+            Patch patch;
+            in >> patch.image >> patch.pos >> patch.zValue;
+            project.patches.append(patch);
+        }
+        if (in.status() != QDataStream::Ok)
+            return fail(QCoreApplication::translate("ProjectFile", "Corrupted project file"));
+
+        uchar *data = file->map(header.pixelsOffset, lineBytes * height, QFileDevice::MapPrivateOption);
+        if (data == nullptr) return fail(file->errorString());
+        auto store = TileStore::global();
+        if (!store->shouldTile(QSize(width, height), QImage(1, 1, format).depth())) {
+            // The alpha plane is small compared to the pixels, so it is simply read
+            BitMatrix alpha(width, height);
+            if (!file->seek(header.alphaOffset)
+                || file->read(reinterpret_cast<char *>(alpha.toBytes()), alphaBytes) != alphaBytes)
+                return fail(file->errorString());
+            QFile *mappedFile = file.release();
+            QImage pixels(data, width, height, static_cast<int>(lineBytes), format, unmapFile, mappedFile);
+            if (pixels.isNull()) {
+                unmapFile(mappedFile);
+                return fail(QCoreApplication::translate("ProjectFile", "Corrupted project file"));
+            }
+            project.buffer = ImageBuffer(pixels, std::move(alpha));
+            return true;
+        }
+
+        // Projects kept in tiles are copied into them a band of rows at a time, from the mapped
+        // pixels and the alpha plane read band by band, so that no full size image is made
+        ImageBuffer buffer(QSize(width, height), format, store);
+        const int bandRows = TileStore::tileSize;
+        for (int top = 0; top < height; top += bandRows) {
+            const int rows = qMin(bandRows, height - top);
+            const QImage band(data + top * lineBytes, width, rows, static_cast<int>(lineBytes), format);
+            buffer.write(QPoint(0, top), band);
+            BitMatrix alpha(width, rows);
+            const qint64 bytes = alphaLineBytes * rows;
+            if (!file->seek(header.alphaOffset + top * alphaLineBytes)
+                || file->read(reinterpret_cast<char *>(alpha.toBytes()), bytes) != bytes)
+                return fail(file->errorString());
+            buffer.writeAlpha(QRect(0, top, width, rows), alpha);
+        }
+        file->unmap(data);
+        project.buffer = buffer;
+        return true;
+    }
+}
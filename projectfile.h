@@ -0,0 +1,41 @@
+#ifndef POISSONEDITOR_PROJECTFILE_H
+#define POISSONEDITOR_PROJECTFILE_H
+
+#include <QtCore>
+#include <QtGui>
+
+#include "imagebuffer.h"
+
+
+// Native project files, which keep everything needed to continue editing
+// The file starts with a header, followed by sections aligned to `sectionAlignment`:
+//   pixels: rows of the image buffer, stored exactly as in memory
+//   alpha:  rows of the alpha plane
+//   scene:  erased rect, lasso path and pasted patches (PNG-compressed), in a QDataStream
+// Pixels are mapped into memory when reading, so opening a project is almost instant and
+// pages are only read from disk when touched. Writes to the mapped pixels stay private.
+// Projects that TileStore::shouldTile are instead copied from the mapping into tiles.
+namespace ProjectFile {
+    struct Patch {
+        QImage image;
+        QPointF pos;
+        qreal zValue;
+    };
+
+    struct Project {
+        ImageBuffer buffer;
+        QRect erasedRect;
+        QPainterPath lassoPath;
+        QList<Patch> patches;
+    };
+
+    extern const char *const suffix;
+    const qint64 sectionAlignment = 64 * 1024; // multiple of the page size on all platforms
+
+    bool isProjectFile(const QString &filePath);
+    bool write(QIODevice *device, const Project &project, QString *errorString);
+    bool read(const QString &filePath, Project &project, QString *errorString);
+}
+
+
+#endif //POISSONEDITOR_PROJECTFILE_H
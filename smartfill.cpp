@@ -1,23 +1,25 @@
+#include <algorithm>
+#include <climits>
+#include <cmath>
 #include <queue>
 
 #include "imagemagic.h"
+#include "kernels.h"
+#include "pixelformat.h"
 #include "utils.h"
 
 #include <QPoint>
+#include <QtConcurrent>
+#include <QtCore>
 #include "qdebug.h"
 
-#include <opencv2/opencv.hpp>
-
-static const int whl = 5; // window half length
-static const int windowSize = whl * 2 + 1;
-
-static const float INFI = (float)windowSize * windowSize * 255 * 255;
+#include <opencv2/core.hpp>
 
 typedef float Float;
 
 template <typename T>
 class SparseTable {
-    int n, m;
+    int n, m, whl;
     utils::Matrix<T> mat;
 
     inline bool isValid(int x, int y) {
@@ -25,13 +27,17 @@ class SparseTable {
     }
 
 public:
-    SparseTable(int n, int m)
-            : n(n), m(m), mat(n, m) {}
+    SparseTable(int n, int m, int whl)
+            : n(n), m(m), whl(whl), mat(n, m) {}
 
     void modify(int x, int y, const T &val) {
         mat(x, y) = val;
     }
 
+    const T &value(int x, int y) const {
+        return mat(x, y);
+    }
+
     T query(int x, int y) {
         T ret = 0;
         for (int dx = -whl; dx <= whl; ++dx)
@@ -41,17 +47,162 @@ public:
     }
 };
 
-using ImageMagic::Color;
 using ImageMagic::dir;
 
+// Checkpoints of a fill in progress, with the image, the known pixels and their confidence
+// Everything else the filler keeps is derived from these, so a fill continued from a checkpoint
+// ends exactly like one that was never interrupted. The file is named after a hash of the input.
+namespace Checkpoint {
+    static const quint32 magic = 0x50455343; // "PESC"
+    static const quint32 version = 2;
+
+    // Confidence is stored by rows, like the image and the mask
+    struct State {
+        QImage image;
+        QByteArray mask, confidence;
+        qint32 progress = 0;
+    };
+
+    static QByteArray imageBytes(const QImage &image) {
+        return QByteArray::fromRawData(reinterpret_cast<const char *>(image.constBits()),
+                                       image.bytesPerLine() * image.height());
+    }
+
+    static QString path(const QString &directory, const QImage &image, const BitMatrix &mask,
+                        const ImageMagic::SmartFillOptions &options) {
+        QCryptographicHash hash(QCryptographicHash::Sha1);
+        const int lineBytes = (image.width() * image.depth() + 7) / 8; // rows may have undefined padding
+        for (int y = 0; y < image.height(); ++y)
+            hash.addData(reinterpret_cast<const char *>(image.constScanLine(y)), lineBytes);
+        hash.addData(reinterpret_cast<const char *>(mask.toBytes()), mask.rows() * mask.cols());
+        // Options that change the result
+        QByteArray parameters;
+        QDataStream(&parameters, QIODevice::WriteOnly)
+                << static_cast<quint32>(image.format()) << image.width() << image.height() << options.windowSize
+                << options.batchSize << options.searchRadius << options.poorMatchRms;
+        hash.addData(parameters);
+        return QDir(directory).filePath(QString::fromLatin1(hash.result().toHex()) + ".smartfill");
+    }
+
+    // Remove the checkpoints of fills that never finished: those older than `maxAgeDays`, then the
+    // oldest ones while all of them take more than `maxBytes`. `keep` is the one of the fill starting.
+    static void prune(const QString &directory, const QString &keep, int maxAgeDays, qint64 maxBytes) {
+        // Oldest first, with the temporary files of writes that were interrupted
+        QFileInfoList files = QDir(directory).entryInfoList({"*.smartfill*"}, QDir::Files, QDir::Time | QDir::Reversed);
+        qint64 total = 0;
+        for (const QFileInfo &file : files)
+            total += file.size();
+        QDateTime expiry = QDateTime::currentDateTime().addDays(-maxAgeDays);
+        for (const QFileInfo &file : files) {
+            if (file.lastModified() >= expiry && total <= maxBytes) break;
+            if (file.absoluteFilePath() == QFileInfo(keep).absoluteFilePath()) continue;
+            if (QFile::remove(file.absoluteFilePath())) total -= file.size();
+        }
+    }
+
+    // Runs on a worker thread, the filler leaves `state` alone until it is done
+    static void write(const QString &filePath, const State &state) {
+        QDir().mkpath(QFileInfo(filePath).absolutePath());
+        QSaveFile file(filePath);
+        if (file.open(QIODevice::WriteOnly)) {
+            QDataStream out(&file);
+            out.setVersion(QDataStream::Qt_5_0);
+            out << magic << version << state.progress << qCompress(imageBytes(state.image), 1)
+                << qCompress(state.mask, 1) << qCompress(state.confidence, 1);
+            if (out.status() == QDataStream::Ok && file.commit()) return;
+        }
+        qDebug() << "Checkpoint::write : cannot write" << filePath << ":" << file.errorString();
+    }
+
+    // Sizes are checked against `image`, the hash in the name covers the rest
+    static bool read(const QString &filePath, const QImage &image, int maskBytes, int confidenceBytes, State &state) {
+        QFile file(filePath);
+        if (!file.open(QIODevice::ReadOnly)) return false;
+        QDataStream in(&file);
+        in.setVersion(QDataStream::Qt_5_0);
+        quint32 fileMagic, fileVersion;
+        QByteArray pixels;
+        in >> fileMagic >> fileVersion;
+        if (fileMagic != magic || fileVersion != version) return false;
+        in >> state.progress >> pixels >> state.mask >> state.confidence;
+        pixels = qUncompress(pixels);
+        state.mask = qUncompress(state.mask);
+        state.confidence = qUncompress(state.confidence);
+        if (in.status() != QDataStream::Ok || pixels.size() != imageBytes(image).size()
+            || state.mask.size() != maskBytes || state.confidence.size() != confidenceBytes) {
+            qDebug() << "Checkpoint::read : ignoring damaged checkpoint" << filePath;
+            return false;
+        }
+        state.image = image.copy();
+        memcpy(state.image.bits(), pixels.constData(), static_cast<size_t>(pixels.size()));
+        return true;
+    }
+}
+
+// Side of the tiles of centers searched at once by FFT, bounding its transforms to about
+// (fftTileSize + windowSize)² doubles each
+static const int fftTileSize = 256;
+
+// Channels are compared in 8 bits whatever the layout, pixels are copied as they are
+template <typename Layout>
 class SmartFiller {
-    QImage image;
+    static const int channels = Layout::channels;
+
+    QImage &image;
     BitMatrix mask;
+    const ImageMagic::SmartFillOptions options;
+    const int whl, windowSize; // window half length and size
 
     int n, m;
+    uchar *bits;
+    int bytesPerLine;
 
     SparseTable<float> confidenceTable;
 
+    // Centers of the windows inside the image with all pixels known, the candidate sources
+    // Filling only turns windows valid, so the map is built once and updated around each patch.
+    BitMatrix validWindow;
+    utils::Matrix<ushort> unknownCount; // unknown pixels in the window around each valid center
+
+    // Color gradient, summed over channels, at each pixel whose four neighbors are known
+    // Known pixels never change, so a gradient never changes once defined; for the data term, the
+    // position of the largest gradient in each window is kept as well, -1 if there is none.
+    struct Gradient {
+        short dx, dy;
+    };
+    static const short undefinedGradient = SHRT_MIN;
+    utils::Matrix<Gradient> gradient;
+    utils::Matrix<int> windowMaxGradient; // position x * m + y, ties go to the smallest
+
+    // Known pixels in planar 8-bit channels, rows padded on both sides for the SSD kernel
+    std::vector<uchar> planes;
+    int pad = 0, stride = 0, planeSize = 0;
+
+    // Working memory of the iterations, kept between them so that they allocate nothing once it
+    // has grown to the size needed: the ranked fill front, and the targets of the batch with the
+    // scratch space of their searches
+    struct Search {
+        QPoint target, source;
+        utils::Arena *workspace;
+    };
+    std::vector<std::pair<Float, QPoint>> fillFront;
+    std::vector<Search> batch;
+    std::vector<utils::Arena> searchWorkspaces;
+    int fillFrontGrowths = 0;
+
+    // State last checkpointed, only read by the write in progress until it is done, and the rows
+    // filled since it was taken
+    Checkpoint::State snapshot;
+    std::vector<char> rowFilled;
+
+    // Heap allocations made for the working memory so far
+    int allocations() const {
+        int count = fillFrontGrowths;
+        for (auto &workspace : searchWorkspaces)
+            count += workspace.allocations();
+        return count;
+    }
+
     inline bool isValid(int x, int y) {
         return x >= 0 && x < n && y >= 0 && y < m;
     }
@@ -60,9 +211,17 @@ class SmartFiller {
         return x >= whl && x + whl < n && y >= whl && y + whl < m;
     }
 
+    inline uchar *line(int y) {
+        return bits + static_cast<ptrdiff_t>(y) * bytesPerLine;
+    }
+
     inline int colorDiff(int x1, int y1, int x2, int y2) {
-        auto col1 = image.pixelColor(x1, y1), col2 = image.pixelColor(x2, y2);
-        int val = (col1.red() - col2.red()) + (col1.green() - col2.green()) + (col1.blue() - col2.blue());
+        int col1[channels], col2[channels];
+        PixelFormat::load8<Layout>(line(y1), x1, col1);
+        PixelFormat::load8<Layout>(line(y2), x2, col2);
+        int val = 0;
+        for (int ch = 0; ch < channels; ++ch)
+            val += col1[ch] - col2[ch];
         return val;
     };
 
@@ -76,146 +235,553 @@ class SmartFiller {
     }
 
 public:
-    SmartFiller(const QImage &image, const BitMatrix &mask)
-            : image(image), mask(mask), n(image.width()), m(image.height()),
-              confidenceTable(n, m) {}
+    SmartFiller(QImage &image, const BitMatrix &mask, const ImageMagic::SmartFillOptions &options)
+            : image(image), mask(mask), options(options),
+              whl(utils::clamp(options.windowSize, 3, ImageMagic::SmartFillOptions::maxWindowSize) / 2),
+              windowSize(whl * 2 + 1), n(image.width()), m(image.height()),
+              bits(image.bits()), bytesPerLine(image.bytesPerLine()), confidenceTable(n, m, whl),
+              validWindow(n, m), unknownCount(n, m), gradient(n, m), windowMaxGradient(n, m) {}
 
-    QImage compute() {
-        // Initialize confidence term values
+    // Erode the known region with the window, counting unknown pixels along rows and then columns
+    void initValidWindows() {
+        utils::Matrix<ushort> rowCount(n, m);
+        for (int j = 0; j < m; ++j) {
+            int count = 0;
+            for (int i = 0; i < n; ++i) {
+                count += !mask(i, j);
+                if (i >= windowSize) count -= !mask(i - windowSize, j);
+                if (i + 1 >= windowSize) rowCount(i - whl, j) = static_cast<ushort>(count);
+            }
+        }
+        for (int i = whl; i + whl < n; ++i) {
+            int count = 0;
+            for (int j = 0; j < m; ++j) {
+                count += rowCount(i, j);
+                if (j >= windowSize) count -= rowCount(i, j - windowSize);
+                if (j + 1 >= windowSize) {
+                    unknownCount(i, j - whl) = static_cast<ushort>(count);
+                    if (count == 0) validWindow(i, j - whl) = true;
+                }
+            }
+        }
+    }
+
+    // Pixel (x, y) became known and its color was set, update the windows and gradients depending on it
+    void markKnown(int x, int y) {
+        int left = std::max(x - whl, whl), right = std::min(x + whl, n - whl - 1);
+        int top = std::max(y - whl, whl), bottom = std::min(y + whl, m - whl - 1);
+        for (int i = left; i <= right; ++i)
+            for (int j = top; j <= bottom; ++j)
+                if (--unknownCount(i, j) == 0) validWindow(i, j) = true;
+        for (int d = 0; d < 4; ++d)
+            if (defineGradient(x + dir[d][0], y + dir[d][1])) {
+                int i = x + dir[d][0], j = y + dir[d][1];
+                int position = i * m + j;
+                for (int cx = std::max(i - whl, 0); cx <= std::min(i + whl, n - 1); ++cx)
+                    for (int cy = std::max(j - whl, 0); cy <= std::min(j + whl, m - 1); ++cy)
+                        if (largerGradient(position, windowMaxGradient(cx, cy))) windowMaxGradient(cx, cy) = position;
+            }
+    }
+
+    inline int gradientLength(int position) const {
+        const Gradient &g = gradient(position / m, position % m);
+        return g.dx * g.dx + g.dy * g.dy;
+    }
+
+    // Whether the gradient at `position` wins over the one at `other` for a window maximum
+    inline bool largerGradient(int position, int other) const {
+        if (position < 0) return false;
+        if (other < 0) return true;
+        int length = gradientLength(position), otherLength = gradientLength(other);
+        return length > otherLength || (length == otherLength && position < other);
+    }
+
+    // Compute the gradient at (x, y) if it was undefined and its neighbors are now known
+    bool defineGradient(int x, int y) {
+        if (x <= 0 || x + 1 >= n || y <= 0 || y + 1 >= m) return false;
+        Gradient &g = gradient(x, y);
+        if (g.dx != undefinedGradient) return false;
+        if (!(mask(x + 1, y) && mask(x - 1, y) && mask(x, y + 1) && mask(x, y - 1))) return false;
+        g.dx = static_cast<short>(colorDiff(x + 1, y, x - 1, y));
+        g.dy = static_cast<short>(colorDiff(x, y + 1, x, y - 1));
+        return true;
+    }
+
+    // Gradients of the known image and the largest one in each window, maximized along rows and then columns
+    void initGradients() {
         for (int i = 0; i < n; ++i)
-            for (int j = 0; j < m; ++j)
-                if (mask(i, j)) confidenceTable.modify(i, j, 1.0);
-
-        int totalPixels = 0;
-        // Initiliaze cv::Mat for convolution
-        cv::Mat mat[3];
-        cv::Mat squared(n, m, CV_32S);
-        for (int ch = 0; ch < 3; ++ch)
-            mat[ch] = cv::Mat(n, m, CV_8UC1);
+            for (int j = 0; j < m; ++j) {
+                gradient(i, j).dx = undefinedGradient;
+                defineGradient(i, j);
+            }
+        utils::Matrix<int> rowMax(n, m);
+        for (int i = 0; i < n; ++i)
+            for (int j = 0; j < m; ++j) {
+                int best = -1;
+                for (int x = std::max(i - whl, 0); x <= std::min(i + whl, n - 1); ++x)
+                    if (gradient(x, j).dx != undefinedGradient && largerGradient(x * m + j, best)) best = x * m + j;
+                rowMax(i, j) = best;
+            }
+        for (int i = 0; i < n; ++i)
+            for (int j = 0; j < m; ++j) {
+                int best = -1;
+                for (int y = std::max(j - whl, 0); y <= std::min(j + whl, m - 1); ++y)
+                    if (largerGradient(rowMax(i, y), best)) best = rowMax(i, y);
+                windowMaxGradient(i, j) = best;
+            }
+    }
+
+    // Source whose window best matches the known pixels around `target`, scanning the current planes
+    // Scratch buffers come from `workspace`, which is reset; searches running together need their own.
+    QPoint findSource(const QPoint &target, utils::Arena &workspace) const {
+        int x = target.x(), y = target.y();
+        workspace.reset();
+        auto *targetPixels = workspace.allocate<uchar>(channels * windowSize * windowSize);
+        auto *weight = workspace.allocate<uchar>(windowSize * windowSize);
+        for (int dy = 0; dy < windowSize; ++dy)
+            for (int dx = 0; dx < windowSize; ++dx) {
+                int i = x - whl + dx, j = y - whl + dy;
+                weight[dy * windowSize + dx] = static_cast<uchar>(mask(i, j));
+                for (int ch = 0; ch < channels; ++ch)
+                    targetPixels[(ch * windowSize + dy) * windowSize + dx] = planes[ch * planeSize + j * stride + pad + i];
+            }
+
+        int known = 0;
+        for (int k = 0; k < windowSize * windowSize; ++k)
+            known += weight[k];
+        const double poorMatchError = options.poorMatchRms * options.poorMatchRms * known * channels;
+
+        // Sources are looked for within the radius first, which is doubled while there are none
+        // or the best one is a poor match, until the whole image is covered
+        const int wholeImage = std::max(n, m);
+        int radius = options.searchRadius > 0 ? std::min(options.searchRadius, wholeImage) : wholeImage;
+        while (true) {
+            int bestVal;
+            QRect area(x - radius, y - radius, 2 * radius + 1, 2 * radius + 1);
+            QPoint bestSrc = windowSize >= options.fftCrossover
+                             ? searchWithinFft(area, targetPixels, weight, &bestVal, workspace)
+                             : searchWithin(area, targetPixels, weight, &bestVal);
+            if (radius >= wholeImage) return bestSrc;
+            if (bestSrc.x() != -1 && (options.poorMatchRms <= 0 || bestVal <= poorMatchError)) return bestSrc;
+            radius = std::min(radius * 2, wholeImage);
+        }
+    }
+
+    // Best source centered inside `area`, the smallest masked SSD with ties going to the smallest x, then y
+    QPoint searchWithin(const QRect &area, const uchar *targetPixels, const uchar *weight, int *bestVal) const {
+        const Kernels::MaskedSsdRow maskedSsdRow = Kernels::maskedSsdRow(Kernels::table(), windowSize);
+        int left = std::max(area.left(), whl), right = std::min(area.right() + 1, n - whl);
+        int top = std::max(area.top(), whl), bottom = std::min(area.bottom() + 1, m - whl);
+        int bestX = -1;
+        *bestVal = windowSize * windowSize * 255 * 255 * channels;
+        QPoint bestSrc(-1, -1);
+        for (int j = top; j < bottom; ++j) {
+            const uchar *rowSrc = planes.data() + (j - whl) * stride + pad;
+            const uchar *rowValid = validWindow.toBytes() + j * validWindow.rows();
+            int prevX = bestX, prevVal = *bestVal;
+            maskedSsdRow(rowSrc, planeSize, stride, channels, targetPixels, weight, windowSize,
+                         rowValid, left, right, bestVal, &bestX);
+            if (bestX != prevX || *bestVal != prevVal) bestSrc = QPoint(bestX, j);
+        }
+        return bestSrc;
+    }
+
+    // Same as searchWithin, with the sums over windows computed as cross-correlations through the DFT
+    // The SSD expands into Σ w·s² - 2 Σ w·t·s + Σ w·t², with s the source and t the target. Sums are
+    // taken in double precision and rounded, which gives the exact integer SSD.
+    // Centers are taken in tiles of at most fftTileSize per side, so that the transforms take the
+    // same memory whatever the area; the spectra of the target are shared by the tiles.
+    QPoint searchWithinFft(const QRect &area, const uchar *targetPixels, const uchar *weight, int *bestVal,
+                           utils::Arena &workspace) const {
+        int left = std::max(area.left(), whl), right = std::min(area.right() + 1, n - whl);
+        int top = std::max(area.top(), whl), bottom = std::min(area.bottom() + 1, m - whl);
+        *bestVal = windowSize * windowSize * 255 * 255 * channels;
+        QPoint bestSrc(-1, -1);
+        if (left >= right || top >= bottom) return bestSrc;
+
+        // Pixels of the windows centered in a tile, the correlation does not wrap around inside it
+        int maxRows = std::min(bottom - top, fftTileSize) + windowSize - 1;
+        int maxCols = std::min(right - left, fftTileSize) + windowSize - 1;
+        cv::Size dftSize(cv::getOptimalDFTSize(maxCols), cv::getOptimalDFTSize(maxRows));
+        // Matrices are all made over workspace memory and operations write into them in place
+        auto workspaceMat = [&workspace, &dftSize]() {
+            return cv::Mat(dftSize, CV_64F, workspace.allocate<double>(dftSize.area()));
+        };
+        cv::Mat region = workspaceMat(), squares = workspaceMat(), regionSpectrum = workspaceMat();
+        cv::Mat product = workspaceMat(), total = workspaceMat(), ssd = workspaceMat();
+        // Spectra of the target channels, then of the weights; headers only, over workspace memory
+        cv::Mat kernelSpectra[channels + 1];
+        double targetSquares = 0;
+        cv::Mat kernel = workspaceMat();
+        for (int ch = 0; ch <= channels; ++ch) {
+            kernel.setTo(0);
+            for (int dy = 0; dy < windowSize; ++dy)
+                for (int dx = 0; dx < windowSize; ++dx) {
+                    if (weight[dy * windowSize + dx] == 0) continue;
+                    double val = ch < channels ? targetPixels[(ch * windowSize + dy) * windowSize + dx] : 1.0;
+                    kernel.at<double>(dy, dx) = val;
+                    if (ch < channels) targetSquares += val * val;
+                }
+            kernelSpectra[ch] = workspaceMat();
+            cv::dft(kernel, kernelSpectra[ch]);
+        }
+
+        int bestX = -1, bestY = -1;
+        for (int tileTop = top; tileTop < bottom; tileTop += fftTileSize)
+            for (int tileLeft = left; tileLeft < right; tileLeft += fftTileSize) {
+                int tileBottom = std::min(tileTop + fftTileSize, bottom), tileRight = std::min(tileLeft + fftTileSize, right);
+                int rows = tileBottom - tileTop + windowSize - 1, cols = tileRight - tileLeft + windowSize - 1;
+                squares.setTo(0);
+                total.setTo(0);
+                for (int ch = 0; ch < channels; ++ch) {
+                    region.setTo(0);
+                    const uchar *plane = planes.data() + ch * planeSize + pad;
+                    for (int r = 0; r < rows; ++r) {
+                        const uchar *row = plane + (tileTop - whl + r) * stride + tileLeft - whl;
+                        for (int c = 0; c < cols; ++c) {
+                            double val = row[c];
+                            region.at<double>(r, c) = val;
+                            squares.at<double>(r, c) += val * val;
+                        }
+                    }
+                    cv::dft(region, regionSpectrum);
+                    cv::mulSpectrums(regionSpectrum, kernelSpectra[ch], product, 0, true);
+                    cv::scaleAdd(product, -2.0, total, total);
+                }
+                cv::dft(squares, regionSpectrum);
+                cv::mulSpectrums(regionSpectrum, kernelSpectra[channels], product, 0, true);
+                cv::add(total, product, total);
+                cv::dft(total, ssd, cv::DFT_INVERSE | cv::DFT_SCALE | cv::DFT_REAL_OUTPUT);
+
+                // Same tie-break as the SSD kernel, tiles further down may hold a smaller x
+                for (int j = tileTop; j < tileBottom; ++j) {
+                    const double *row = ssd.ptr<double>(j - tileTop);
+                    for (int i = tileLeft; i < tileRight; ++i) {
+                        if (!validWindow(i, j)) continue;
+                        auto val = static_cast<int>(std::llround(row[i - tileLeft] + targetSquares));
+                        if (val < *bestVal || (val == *bestVal && (i < bestX || (i == bestX && j < bestY)))) {
+                            *bestVal = val;
+                            bestX = i, bestY = j;
+                            bestSrc = QPoint(i, j);
+                        }
+                    }
+                }
+            }
+        return bestSrc;
+    }
+
+    void setColor(int i, int j, const int *col) {
+        for (int ch = 0; ch < channels; ++ch)
+            planes[ch * planeSize + j * stride + pad + i] = static_cast<uchar>(col[ch]);
+    }
+
+    // Copy row `j` of the filler state into the snapshot
+    void snapshotRow(int j) {
+        memcpy(snapshot.image.scanLine(j), line(j), static_cast<size_t>(bytesPerLine));
+        memcpy(snapshot.mask.data() + j * mask.rows(), mask.toBytes() + j * mask.rows(), static_cast<size_t>(mask.rows()));
+        auto *confidence = reinterpret_cast<float *>(snapshot.confidence.data()) + j * n;
+        for (int i = 0; i < n; ++i)
+            confidence[i] = confidenceTable.value(i, j);
+    }
+
+    // Bring the snapshot up to date, copying only the rows filled since the previous checkpoint
+    void updateSnapshot(int progress) {
+        if (snapshot.image.isNull()) {
+            // Pixels are written through `bits`, so the snapshot cannot share them; the first one
+            // copies every row
+            snapshot.image = QImage(n, m, image.format());
+            snapshot.mask.resize(mask.rows() * mask.cols());
+            snapshot.confidence.resize(static_cast<int>(sizeof(float)) * n * m);
+            std::fill(rowFilled.begin(), rowFilled.end(), true);
+        }
+        for (int j = 0; j < m; ++j)
+            if (rowFilled[j]) {
+                snapshotRow(j);
+                rowFilled[j] = false;
+            }
+        snapshot.progress = progress;
+    }
+
+    void restore(const Checkpoint::State &state) {
+        for (int y = 0; y < m; ++y)
+            memcpy(line(y), state.image.constScanLine(y), static_cast<size_t>(bytesPerLine));
+        memcpy(mask.toBytes(), state.mask.constData(), static_cast<size_t>(state.mask.size()));
+        auto *confidence = reinterpret_cast<const float *>(state.confidence.constData());
+        for (int j = 0; j < m; ++j)
+            for (int i = 0; i < n; ++i)
+                confidenceTable.modify(i, j, confidence[j * n + i]);
+    }
+
+    void compute() {
+        QString checkpointPath;
+        int progress = 0;
+        bool resumed = false;
+        rowFilled.assign(static_cast<size_t>(m), false);
+        if (!options.checkpointDirectory.isEmpty()) {
+            checkpointPath = Checkpoint::path(options.checkpointDirectory, image, mask, options);
+            Checkpoint::prune(options.checkpointDirectory, checkpointPath, options.checkpointMaxAgeDays,
+                              options.checkpointMaxMB * (1ll << 20));
+            Checkpoint::State state;
+            if (Checkpoint::read(checkpointPath, image, mask.rows() * mask.cols(),
+                                 static_cast<int>(sizeof(float)) * n * m, state)) {
+                restore(state);
+                progress = state.progress;
+                resumed = true;
+                // The checkpoint read is the state restored, and becomes the first snapshot
+                snapshot = std::move(state);
+                qDebug() << "SmartFiller : resuming from" << checkpointPath << "at" << progress;
+            }
+        }
+        if (!resumed) {
+            // Initialize confidence term values
+            for (int i = 0; i < n; ++i)
+                for (int j = 0; j < m; ++j)
+                    if (mask(i, j)) confidenceTable.modify(i, j, 1.0);
+        }
+
+        int totalPixels = progress;
+        // Known pixels in planar 8-bit channels, rows padded on both sides for the SSD kernel
+        pad = Kernels::ssdLanes + windowSize, stride = n + 2 * pad;
+        planeSize = stride * m;
+        planes.assign(static_cast<size_t>(planeSize) * channels, 0);
         for (int i = 0; i < n; ++i)
             for (int j = 0; j < m; ++j)
                 if (mask(i, j)) {
-                    auto col = Color(image.pixelColor(i, j));
-                    for (int ch = 0; ch < 3; ++ch)
-                        mat[ch].at<uchar>(i, j) = static_cast<uchar>(col.col[ch]);
-                    squared.at<int>(i, j) = col.norm();
+                    int col[channels];
+                    PixelFormat::load8<Layout>(line(j), i, col);
+                    setColor(i, j, col);
                 } else {
                     ++totalPixels;
-                    for (int ch = 0; ch < 3; ++ch)
-                        mat[ch].at<uchar>(i, j) = 0;
                 }
 
-        int progress = 0;
+        initValidWindows();
+        initGradients();
+        const int batchSize = std::max(options.batchSize, 1);
+        searchWorkspaces.clear();
+        for (int k = 0; k < batchSize; ++k)
+            searchWorkspaces.emplace_back();
+        batch.reserve(static_cast<size_t>(batchSize));
+        QElapsedTimer sinceCheckpoint;
+        sinceCheckpoint.start();
+        QFuture<void> checkpointWrite;
         while (true) {
+            const int allocationsBefore = allocations();
+            const size_t fillFrontCapacity = fillFront.capacity();
+
             // Initialize data term values & find fill front pixels
             // Sort fill front pixels according to priority
-            Float bestScore = INT_MIN;
-            QPoint bestTgt(-1, -1);
-            std::vector<QPoint> fillFront;
+            fillFront.clear();
             for (int i = 0; i < n; ++i)
                 for (int j = 0; j < m; ++j) {
                     if (!isFillFront(i, j)) continue;
-                    fillFront.emplace_back(i, j);
                     int nX = mask(i + 1, j) - mask(i - 1, j);
                     int nY = mask(i, j + 1) - mask(i, j - 1);
                     Float dataVal = 0.0;
-                    if (nX != 0 || nY != 0) {
-                        int maxVal = 0, maxLen = 0;
-                        for (int dx = -whl; dx <= whl; ++dx)
-                            for (int dy = -whl; dy <= whl; ++dy) {
-                                int x = i + dx, y = j + dy;
-                                if (!(mask(x + 1, y) && mask(x - 1, y) && mask(x, y + 1) && mask(x, y - 1))) continue;
-                                int dX = colorDiff(x + 1, y, x - 1, y);
-                                int dY = colorDiff(x, y + 1, x, y - 1);
-                                int curLen = dX * dX + dY * dY;
-                                if (curLen > maxLen) {
-                                    maxLen = curLen;
-                                    maxVal = std::abs(dX * nX + dY * nY);
-                                }
-                            }
+                    int maxPosition = windowMaxGradient(i, j);
+                    if ((nX != 0 || nY != 0) && maxPosition >= 0) {
+                        const Gradient &g = gradient(maxPosition / m, maxPosition % m);
+                        int maxVal = std::abs(g.dx * nX + g.dy * nY);
                         auto len = static_cast<float>(sqrt(nX * nX + nY * nY));
                         dataVal = maxVal / len;
                     }
                     Float score = confidenceTable.query(i, j) * (dataVal + 0.001f);
-                    if (score > bestScore) {
-                        bestScore = score;
-                        bestTgt = {i, j};
-                    }
+                    fillFront.emplace_back(score, QPoint(i, j));
                 }
-            if (bestTgt.x() == -1) break;
-            int x = bestTgt.x(), y = bestTgt.y();
-
-            // Calculate MSE between kernel and all patches
-            cv::Mat error(n, m, CV_32S);
-            cv::Mat maskKernel(windowSize, windowSize, CV_8UC1);
-            for (int dx = -whl; dx <= whl; ++dx)
-                for (int dy = -whl; dy <= whl; ++dy)
-                    maskKernel.at<uchar>(dx + whl, dy + whl) = static_cast<uchar>(mask(x + dx, y + dy));
-            cv::filter2D(squared, error, CV_32S, maskKernel);
-            for (int ch = 0; ch < 3; ++ch) {
-                cv::Mat result(n, m, CV_32S);
-                cv::Mat kernel(windowSize, windowSize, CV_8UC1);
-                for (int dx = -whl; dx <= whl; ++dx)
-                    for (int dy = -whl; dy <= whl; ++dy)
-                        kernel.at<uchar>(dx + whl, dy + whl) = mat[ch].at<uchar>(x + dx, y + dy);
-                cv::filter2D(mat[ch], result, CV_32S, kernel);
-                error -= result * 2;
+            if (fillFront.capacity() != fillFrontCapacity) ++fillFrontGrowths;
+            if (fillFront.empty()) break;
+            // Equal scores keep the scan order, so the batch does not depend on the sort
+            std::sort(fillFront.begin(), fillFront.end(),
+                      [](const std::pair<Float, QPoint> &a, const std::pair<Float, QPoint> &b) {
+                          if (a.first != b.first) return a.first > b.first;
+                          return a.second.x() != b.second.x() ? a.second.x() < b.second.x() : a.second.y() < b.second.y();
+                      });
+
+            // Take targets by priority whose windows do not overlap those already taken: none of
+            // them then reads pixels another one fills, and they can be searched for at the same time
+            batch.clear();
+            for (auto &front : fillFront) {
+                if (static_cast<int>(batch.size()) == batchSize) break;
+                const QPoint &p = front.second;
+                bool overlaps = std::any_of(batch.begin(), batch.end(), [this, &p](const Search &t) {
+                    return std::abs(t.target.x() - p.x()) < windowSize && std::abs(t.target.y() - p.y()) < windowSize;
+                });
+                if (!overlaps) batch.push_back({p, QPoint(-1, -1), &searchWorkspaces[batch.size()]});
             }
+            auto search = [this](Search &t) {
+                t.source = findSource(t.target, *t.workspace);
+            };
+            if (batch.size() == 1) search(batch[0]);
+            else QtConcurrent::blockingMap(batch, search);
 
-            // Filter out partially filled patches
-            BitMatrix validWindow = mask;
-            for (auto &p : fillFront) {
-                int x = p.x(), y = p.y();
+            // Modify existing matrices, in priority order
+            // Without a fully known window anywhere there is nothing to copy from, and the target
+            // would come up again in the next iteration, so the fill stops with it left unknown.
+            bool noSource = false;
+            for (auto &t : batch) {
+                if (t.source.x() < 0) {
+                    noSource = true;
+                    continue;
+                }
+                int x = t.target.x(), y = t.target.y(), srcX = t.source.x(), srcY = t.source.y();
+//                qDebug() << t.target << t.source;
+                float confidenceValue = confidenceTable.query(x, y) / (windowSize * windowSize);
+                assert(confidenceValue < 1.0);
                 for (int dx = -whl; dx <= whl; ++dx)
                     for (int dy = -whl; dy <= whl; ++dy) {
                         int i = x + dx, j = y + dy;
-                        if (isValid(i, j)) validWindow(i, j) = false;
-                    }
-            }
-
-            // Find the best fit patch
-            float bestVal = INFI;
-            QPoint bestSrc(-1, -1);
-            for (int i = 0; i < n; ++i)
-                for (int j = 0; j < m; ++j)
-                    if (validWindow(i, j) && isValidWindow(i, j)) {
-                        float val = error.at<int>(i, j);
-                        if (val < bestVal) {
-                            bestVal = val;
-                            bestSrc = QPoint(i, j);
+                        if (!mask(i, j)) {
+                            ++progress;
+                            mask(i, j) = true;
+                            rowFilled[j] = true;
+                            int col[channels];
+                            PixelFormat::load8<Layout>(line(srcY + dy), srcX + dx, col);
+                            setColor(i, j, col);
+                            PixelFormat::copyPixel<Layout>(line(j), i, line(srcY + dy), srcX + dx);
+                            markKnown(i, j);
+                            confidenceTable.modify(i, j, confidenceValue);
                         }
                     }
-            int srcX = bestSrc.x(), srcY = bestSrc.y();
-//            qDebug() << bestTgt << bestSrc;
-
-            // Modify existing matrices
-            float confidenceValue = confidenceTable.query(x, y) / (windowSize * windowSize);
-            assert(confidenceValue < 1.0);
-            for (int dx = -whl; dx <= whl; ++dx)
-                for (int dy = -whl; dy <= whl; ++dy) {
-                    int i = x + dx, j = y + dy;
-                    if (!mask(i, j)) {
-                        ++progress;
-                        mask(i, j) = true;
-                        auto col = Color(image.pixelColor(srcX + dx, srcY + dy));
-                        for (int ch = 0; ch < 3; ++ch)
-                            mat[ch].at<uchar>(i, j) = static_cast<uchar>(col.col[ch]);
-                        squared.at<int>(i, j) = col.norm();
-                        image.setPixel(i, j, image.pixel(srcX + dx, srcY + dy));
-                        confidenceTable.modify(i, j, confidenceValue);
-                    }
-                }
-            qDebug() << progress << "/" << totalPixels;
+            }
+            qDebug() << progress << "/" << totalPixels << "allocations:" << allocations() - allocationsBefore;
+            if (noSource) {
+                qWarning() << "SmartFiller : no window of" << windowSize << "known pixels to fill from, stopping at"
+                           << progress << "/" << totalPixels;
+                break;
+            }
 
+            // The rows filled since the last checkpoint are copied here, and the snapshot is written
+            // on a worker while the fill goes on
+            if (!checkpointPath.isEmpty() && checkpointWrite.isFinished()
+                && sinceCheckpoint.elapsed() >= options.checkpointInterval * 1000ll) {
+                updateSnapshot(progress);
+                checkpointWrite = QtConcurrent::run([this, checkpointPath]() { Checkpoint::write(checkpointPath, snapshot); });
+                sinceCheckpoint.restart();
+            }
 //            if (progress > 500) break;
         }
-        qDebug() << "done";
+        if (!checkpointPath.isEmpty()) {
+            checkpointWrite.waitForFinished();
+            QFile::remove(checkpointPath);
+        }
+        qDebug() << "done, working memory allocations:" << allocations();
+    }
+};
 
-        return image;
+template <typename Layout>
+struct SmartFillKernel {
+    static void run(QImage &image, const BitMatrix &mask, const ImageMagic::SmartFillOptions &options) {
+        SmartFiller<Layout> filler(image, mask, options);
+        filler.compute();
     }
 };
 
-QImage ImageMagic::smartFill(const QImage &image, const BitMatrix &imageMask) {
-    auto filler = SmartFiller(image, imageMask);
-    return filler.compute();
+// `image` is in a format with a specialized layout, smartFill converts the others
+static void fillRegion(QImage &image, const BitMatrix &imageMask, const ImageMagic::SmartFillOptions &options) {
+    PixelFormat::dispatch<SmartFillKernel>(image.format(), image, imageMask, options);
+}
+
+// Bounding rects of the 8-connected groups of pixels outside `mask`
+static std::vector<QRect> findHoles(const BitMatrix &mask, int width, int height) {
+    std::vector<QRect> holes;
+    BitMatrix visited = mask;
+    std::vector<QPoint> stack;
+    const uchar *bytes = mask.toBytes();
+    for (int y = 0; y < height; ++y)
+        for (int x = 0; x < width; ++x) {
+            // Bytes without unknown pixels are skipped whole
+            if ((x & 7) == 0 && bytes[y * mask.rows() + (x >> 3)] == 0xff && x + 8 <= width) {
+                x += 7;
+                continue;
+            }
+            if (visited(x, y)) continue;
+            QRect hole(x, y, 1, 1);
+            visited(x, y) = true;
+            stack.emplace_back(x, y);
+            while (!stack.empty()) {
+                QPoint p = stack.back();
+                stack.pop_back();
+                hole |= QRect(p, QSize(1, 1));
+                for (int dx = -1; dx <= 1; ++dx)
+                    for (int dy = -1; dy <= 1; ++dy) {
+                        int i = p.x() + dx, j = p.y() + dy;
+                        if (i < 0 || i >= width || j < 0 || j >= height || visited(i, j)) continue;
+                        visited(i, j) = true;
+                        stack.emplace_back(i, j);
+                    }
+            }
+            holes.push_back(hole);
+        }
+    return holes;
+}
+
+void ImageMagic::smartFill(QImage &image, const BitMatrix &imageMask, const SmartFillOptions &options) {
+    // Formats without a specialized layout are filled in ARGB32, converted once for all regions
+    // so that the pixels copied back are in the format they were filled in. Filled pixels are
+    // copies of known ones, so indexed images map back exactly onto their own color table.
+    if (!PixelFormat::supports(image.format())) {
+        QImage converted = image.convertToFormat(QImage::Format_ARGB32);
+        smartFill(converted, imageMask, options);
+        image = image.colorTable().isEmpty() ? converted.convertToFormat(image.format())
+                                             : converted.convertToFormat(image.format(), image.colorTable());
+        return;
+    }
+
+    if (options.sourceMargin <= 0) {
+        fillRegion(image, imageMask, options);
+        return;
+    }
+
+    // Holes are filled separately, from the pixels within the margin around them. Holes whose
+    // regions overlap are filled together, so the regions are disjoint and can be filled at the same time.
+    std::vector<QRect> regions;
+    const int margin = options.sourceMargin;
+    for (const QRect &hole : findHoles(imageMask, image.width(), image.height()))
+        regions.push_back(hole.adjusted(-margin, -margin, margin, margin).intersected(image.rect()));
+    for (bool merged = true; merged;) {
+        merged = false;
+        for (size_t i = 0; i < regions.size() && !merged; ++i)
+            for (size_t j = i + 1; j < regions.size() && !merged; ++j)
+                if (regions[i].intersects(regions[j])) {
+                    regions[i] |= regions[j];
+                    regions.erase(regions.begin() + j);
+                    merged = true;
+                }
+    }
+    if (regions.size() == 1 && regions[0] == image.rect()) {
+        fillRegion(image, imageMask, options);
+        return;
+    }
+    qDebug() << "ImageMagic::smartFill :" << regions.size() << "regions";
+
+    struct Region {
+        QRect rect;
+        QImage image;
+    };
+    std::vector<Region> work;
+    for (const QRect &rect : regions)
+        work.push_back({rect, image.copy(rect)});
+    QtConcurrent::blockingMap(work, [&imageMask, &options](Region &region) {
+        const QRect &rect = region.rect;
+        fillRegion(region.image, imageMask.subMatrix(rect.x(), rect.y(), rect.width(), rect.height()), options);
+    });
+    for (const Region &region : work)
+        utils::copyRect(image, region.rect.topLeft(), region.image);
+}
+
+ImageMagic::SmartFillOptions ImageMagic::SmartFillOptions::fromSettings() {
+    QSettings settings(QCoreApplication::organizationName(), QCoreApplication::applicationName());
+    SmartFillOptions options;
+    options.windowSize = settings.value("smartFill/windowSize", 11).toInt();
+    options.fftCrossover = settings.value("smartFill/fftCrossover", 21).toInt();
+    options.batchSize = settings.value("smartFill/batchSize", 1).toInt();
+    options.searchRadius = settings.value("smartFill/searchRadius", 0).toInt();
+    options.poorMatchRms = settings.value("smartFill/poorMatchRms", 0).toFloat();
+    options.sourceMargin = settings.value("smartFill/sourceMargin", 256).toInt();
+    // An empty directory turns checkpoints off
+    options.checkpointDirectory = settings.value("smartFill/checkpointDirectory",
+            QDir(QStandardPaths::writableLocation(QStandardPaths::CacheLocation)).filePath("smartfill")).toString();
+    options.checkpointInterval = settings.value("smartFill/checkpointIntervalSec", 30).toInt();
+    options.checkpointMaxAgeDays = settings.value("smartFill/checkpointMaxAgeDays", 7).toInt();
+    options.checkpointMaxMB = settings.value("smartFill/checkpointMaxMB", 1024).toInt();
+    return options;
 }
@@ -0,0 +1,249 @@
+#include <QtConcurrent>
+
+#include "tiledimageitem.h"
+
+
+// 2x2 box filter on premultiplied ARGB, computing the pixels of `rect` in `dst` from `src`,
+// whose top-left pixel lies at `origin` of the finer level
+static void downsampleRect(const QImage &src, const QPoint &origin, QImage &dst, const QRect &rect) {
+    int w = src.width(), h = src.height();
+    for (int y = rect.top(); y <= rect.bottom(); ++y) {
+        int y0 = 2 * y - origin.y(), y1 = qMin(y0 + 1, h - 1);
+        auto *line0 = reinterpret_cast<const QRgb *>(src.constScanLine(y0));
+        auto *line1 = reinterpret_cast<const QRgb *>(src.constScanLine(y1));
+        auto *out = reinterpret_cast<QRgb *>(dst.scanLine(y));
+        for (int x = rect.left(); x <= rect.right(); ++x) {
+            int x0 = 2 * x - origin.x(), x1 = qMin(x0 + 1, w - 1);
+            const QRgb pixels[4] = {line0[x0], line0[x1], line1[x0], line1[x1]};
+            int r = 0, g = 0, b = 0, a = 0;
+            for (auto p : pixels)
+                r += qRed(p), g += qGreen(p), b += qBlue(p), a += qAlpha(p);
+            out[x] = qRgba((r + 2) >> 2, (g + 2) >> 2, (b + 2) >> 2, (a + 2) >> 2);
+        }
+    }
+}
+
+// Compute the pixels of `part` of the level tile covering `tileRect` into `dst`, from the finer
+// level, which is `buffer` if not null
+static void downsampleTile(const ImageBuffer *buffer, const TiledImageItem::Level &finer, TileStore &store,
+                           const QRect &tileRect, const QRect &part, QImage &dst) {
+    QRect source(2 * part.x(), 2 * part.y(), 2 * part.width(), 2 * part.height());
+    if (buffer != nullptr) {
+        source = source.intersected(buffer->rect());
+        downsampleRect(buffer->composite(source), source.topLeft() - 2 * tileRect.topLeft(), dst,
+                       part.translated(-tileRect.topLeft()));
+        return;
+    }
+    // Finer tiles have even sizes except at the right and bottom edges, so no output pixel
+    // depends on two of them
+    source = source.intersected(QRect(QPoint(0, 0), finer.size));
+    const int size = TiledImageItem::tileSize;
+    for (int ty = source.top() / size; ty <= source.bottom() / size; ++ty)
+        for (int tx = source.left() / size; tx <= source.right() / size; ++tx) {
+            QRect finerRect = finer.tileRect(tx, ty);
+            QRect overlap = finerRect.intersected(source);
+            QRect target(QPoint(overlap.left() / 2, overlap.top() / 2), QPoint(overlap.right() / 2, overlap.bottom() / 2));
+            downsampleRect(store.pixels(finer.tileAt(tx, ty)), finerRect.topLeft() - 2 * tileRect.topLeft(), dst,
+                           target.translated(-tileRect.topLeft()));
+        }
+}
+
+static inline quint64 tileKey(int x, int y) {
+    return static_cast<quint64>(y) << 32 | static_cast<quint32>(x);
+}
+
+TiledImageItem::TiledImageItem(QGraphicsItem *parent)
+        : QGraphicsObject(parent), store(TileStore::global()), generation(0) {
+    static_assert(tileSize <= TileStore::tileSize, "level tiles must fit into tiles of the store");
+    qRegisterMetaType<TiledImageItem::Level>("TiledImageItem::Level");
+    setFlag(QGraphicsItem::ItemUsesExtendedStyleOption); // needed for option->exposedRect
+    tileCache.setMaxCost(64 * 1024);
+}
+
+TiledImageItem::~TiledImageItem() {
+    // Workers refer to the item, they stop within one tile once their generation is stale
+    cancelPendingLevels();
+    for (auto &worker : workers)
+        worker.waitForFinished();
+}
+
+void TiledImageItem::setBuffer(const ImageBuffer *buffer) {
+    cancelPendingLevels();
+    prepareGeometryChange();
+
+    this->buffer = buffer;
+    tileCache.clear();
+    levels.clear();
+    levels.emplace_back(); // full resolution tiles are composed from the buffer
+    // Halve until the whole image fits into a single tile
+    QSize size = buffer->size();
+    while (qMax(size.width(), size.height()) > tileSize) {
+        size = QSize((size.width() + 1) / 2, (size.height() + 1) / 2);
+        levels.emplace_back();
+    }
+    update();
+}
+
+void TiledImageItem::invalidate(const QRect &rect) {
+    auto dirty = rect.intersected(buffer->rect());
+    if (dirty.isEmpty()) return;
+    cancelPendingLevels();
+
+    for (int ty = dirty.top() / tileSize; ty <= dirty.bottom() / tileSize; ++ty)
+        for (int tx = dirty.left() / tileSize; tx <= dirty.right() / tileSize; ++tx)
+            tileCache.remove(tileKey(tx, ty));
+
+    // Built levels always form a prefix of the pyramid; their tiles are immutable, so changed
+    // ones are replaced
+    auto levelRect = dirty;
+    for (size_t l = 1; l < levels.size() && !levels[l].isNull(); ++l) {
+        levelRect = QRect(QPoint(levelRect.left() / 2, levelRect.top() / 2),
+                          QPoint(levelRect.right() / 2, levelRect.bottom() / 2));
+        Level &level = levels[l];
+        for (int ty = levelRect.top() / tileSize; ty <= levelRect.bottom() / tileSize; ++ty)
+            for (int tx = levelRect.left() / tileSize; tx <= levelRect.right() / tileSize; ++tx) {
+                QRect rect = level.tileRect(tx, ty);
+                QRect part = rect.intersected(levelRect);
+                QImage pixels = part == rect ? QImage(rect.size(), QImage::Format_ARGB32_Premultiplied)
+                                             : store->pixels(level.tileAt(tx, ty));
+                downsampleTile(l == 1 ? buffer : nullptr, levels[l - 1], *store, rect, part, pixels);
+                level.tileAt(tx, ty) = store->create(pixels);
+            }
+    }
+    update(QRectF(dirty));
+}
+
+QRectF TiledImageItem::boundingRect() const {
+    if (buffer == nullptr) return QRectF();
+    return QRectF(buffer->rect());
+}
+
+void TiledImageItem::paint(QPainter *painter, const QStyleOptionGraphicsItem *option, QWidget *widget) {
+    Q_UNUSED(widget);
+    if (buffer == nullptr || buffer->isNull()) return;
+
+    qreal levelOfDetail = QStyleOptionGraphicsItem::levelOfDetailFromTransform(painter->worldTransform());
+    int level = levelFor(levelOfDetail);
+    // Fall back to the closest finer level while the requested one is being built
+    int available = level;
+    while (available > 0 && levels[available].isNull()) --available;
+    if (available != level) requestLevel(level);
+
+    QRectF exposed = option->exposedRect.intersected(boundingRect());
+    painter->setRenderHint(QPainter::SmoothPixmapTransform);
+
+    if (available == 0) {
+        QRect rect = exposed.toAlignedRect().intersected(buffer->rect());
+        if (rect.isEmpty()) return;
+        // Tiles around the view are likely to be exposed next when panning
+        buffer->prefetch(rect.adjusted(-tileSize, -tileSize, tileSize, tileSize));
+        for (int ty = rect.top() / tileSize; ty <= rect.bottom() / tileSize; ++ty)
+            for (int tx = rect.left() / tileSize; tx <= rect.right() / tileSize; ++tx)
+                painter->drawImage(QPointF(tx * tileSize, ty * tileSize), tile(tx, ty));
+        return;
+    }
+
+    const Level &image = levels[available];
+    QRect bounds(QPoint(0, 0), image.size);
+    qreal sx = static_cast<qreal>(buffer->size().width()) / image.size.width();
+    qreal sy = static_cast<qreal>(buffer->size().height()) / image.size.height();
+    QRect levelRect = QRectF(exposed.x() / sx, exposed.y() / sy, exposed.width() / sx, exposed.height() / sy)
+            .toAlignedRect().intersected(bounds);
+    if (levelRect.isEmpty()) return;
+
+    // Paged out tiles around the view are loaded in the background, like those of the buffer
+    QRect around = levelRect.adjusted(-tileSize, -tileSize, tileSize, tileSize).intersected(bounds);
+    std::vector<TileStore::TilePtr> wanted;
+    for (int ty = around.top() / tileSize; ty <= around.bottom() / tileSize; ++ty)
+        for (int tx = around.left() / tileSize; tx <= around.right() / tileSize; ++tx)
+            wanted.push_back(image.tileAt(tx, ty));
+    store->prefetch(wanted);
+
+    for (int ty = levelRect.top() / tileSize; ty <= levelRect.bottom() / tileSize; ++ty)
+        for (int tx = levelRect.left() / tileSize; tx <= levelRect.right() / tileSize; ++tx) {
+            QRect tile = image.tileRect(tx, ty);
+            QRectF target(tile.x() * sx, tile.y() * sy, tile.width() * sx, tile.height() * sy);
+            painter->drawImage(target, store->pixels(image.tileAt(tx, ty)));
+        }
+}
+
+int TiledImageItem::levelFor(qreal levelOfDetail) const {
+    // Coarsest level whose resolution is still no less than the device resolution
+    int level = 0;
+    while (level + 1 < static_cast<int>(levels.size()) && levelOfDetail * (1 << (level + 1)) <= 1.0) ++level;
+    return level;
+}
+
+QImage TiledImageItem::tile(int x, int y) {
+    auto key = tileKey(x, y);
+    if (QImage *cached = tileCache.object(key)) return *cached;
+    QRect rect = QRect(x * tileSize, y * tileSize, tileSize, tileSize).intersected(buffer->rect());
+    QImage image = buffer->composite(rect);
+    tileCache.insert(key, new QImage(image), image.bytesPerLine() * image.height() / 1024);
+    return image;
+}
+
+void TiledImageItem::requestLevel(int level) {
+    if (pendingLevels.contains(level)) return;
+
+    // Drop finished workers
+    for (auto it = workers.begin(); it != workers.end();) {
+        if (it->isFinished()) it = workers.erase(it);
+        else ++it;
+    }
+
+    int from = level - 1;
+    while (from > 0 && levels[from].isNull()) --from;
+    for (int l = from + 1; l <= level; ++l)
+        pendingLevels.insert(l);
+
+    // The first level is built from a snapshot of the buffer, which is released as soon as possible
+    ImageBuffer snapshot = from == 0 ? *buffer : ImageBuffer();
+    Level finer = levels[from];
+    auto tileStore = store;
+    int gen = generation.loadAcquire();
+    workers.append(QtConcurrent::run([this, snapshot, finer, tileStore, from, level, gen]() mutable {
+        auto stale = [this, gen]() { return generation.loadAcquire() != gen; };
+        for (int l = from + 1; l <= level; ++l) {
+            Level pixels = downsample(l == 1 ? &snapshot : nullptr, finer, *tileStore, stale);
+            snapshot = ImageBuffer();
+            if (pixels.isNull()) return;
+            QMetaObject::invokeMethod(this, "levelReady", Qt::QueuedConnection,
+                                      Q_ARG(int, gen), Q_ARG(int, l), Q_ARG(TiledImageItem::Level, pixels));
+            finer = std::move(pixels);
+        }
+    }));
+}
+
+void TiledImageItem::levelReady(int generation, int level, const TiledImageItem::Level &pixels) {
+    if (generation != this->generation.loadAcquire()) return; // result for an image that has been changed since
+    levels[level] = pixels;
+    pendingLevels.remove(level);
+    update();
+}
+
+// Not waiting for the workers, edits would otherwise block until a whole level is built;
+// their results are dropped by levelReady
+void TiledImageItem::cancelPendingLevels() {
+    generation.fetchAndAddOrdered(1);
+    pendingLevels.clear();
+}
+
+TiledImageItem::Level TiledImageItem::downsample(const ImageBuffer *buffer, const Level &finer, TileStore &store,
+                                                 const std::function<bool()> &stale) {
+    // Odd sizes are rounded up
+    QSize size = buffer != nullptr ? buffer->size() : finer.size;
+    Level level;
+    level.size = QSize((size.width() + 1) / 2, (size.height() + 1) / 2);
+    level.tiles.reserve(static_cast<size_t>(level.columns()) * level.rows());
+    // Tile by tile, so that only a few finer tiles are resident at a time
+    for (int ty = 0; ty < level.rows(); ++ty)
+        for (int tx = 0; tx < level.columns(); ++tx) {
+            if (stale()) return Level();
+            QRect rect = level.tileRect(tx, ty);
+            QImage pixels(rect.size(), QImage::Format_ARGB32_Premultiplied);
+            downsampleTile(buffer, finer, store, rect, rect, pixels);
+            level.tiles.push_back(store.create(pixels));
+        }
+    return level;
+}
@@ -0,0 +1,98 @@
+#ifndef POISSONEDITOR_TILEDIMAGEITEM_H
+#define POISSONEDITOR_TILEDIMAGEITEM_H
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <QtCore>
+#include <QtGui>
+#include <QtWidgets>
+
+#include "imagebuffer.h"
+
+
+// Graphics item for (possibly huge) images
+// Only tiles intersecting the exposed rect are painted, taken from the level of a
+// mipmap pyramid that is closest to the current view scale. Full resolution tiles are
+// composed from the image buffer on demand and cached; coarser levels are built lazily
+// on the global thread pool, finer levels are used until they are ready. Coarser levels
+// are kept in tiles of the global TileStore, so that they are paged with the image.
+class TiledImageItem : public QGraphicsObject {
+Q_OBJECT
+
+public:
+    explicit TiledImageItem(QGraphicsItem *parent = nullptr);
+    ~TiledImageItem() override;
+    TiledImageItem(const TiledImageItem &) = delete;
+    TiledImageItem &operator =(const TiledImageItem &) = delete;
+
+    // The buffer is not owned and must outlive the item
+    void setBuffer(const ImageBuffer *buffer);
+    // Must be called after the buffer is changed inside `rect`
+    void invalidate(const QRect &rect);
+
+    QRectF boundingRect() const override;
+    void paint(QPainter *painter, const QStyleOptionGraphicsItem *option, QWidget *widget) override;
+
+    static const int tileSize = 256;
+
+    // Level of the pyramid, null until built
+    struct Level {
+        QSize size;
+        std::vector<TileStore::TilePtr> tiles; // row-major, premultiplied ARGB
+
+        inline bool isNull() const {
+            return tiles.empty();
+        }
+
+        inline int columns() const {
+            return (size.width() + tileSize - 1) / tileSize;
+        }
+
+        inline int rows() const {
+            return (size.height() + tileSize - 1) / tileSize;
+        }
+
+        inline const TileStore::TilePtr &tileAt(int x, int y) const {
+            return tiles[static_cast<size_t>(y) * columns() + x];
+        }
+
+        inline TileStore::TilePtr &tileAt(int x, int y) {
+            return tiles[static_cast<size_t>(y) * columns() + x];
+        }
+
+        inline QRect tileRect(int x, int y) const {
+            return QRect(x * tileSize, y * tileSize, tileSize, tileSize).intersected(QRect(QPoint(0, 0), size));
+        }
+    };
+
+private slots:
+    void levelReady(int generation, int level, const TiledImageItem::Level &pixels);
+
+private:
+    int levelFor(qreal levelOfDetail) const;
+    QImage tile(int x, int y);
+    void requestLevel(int level);
+    void cancelPendingLevels();
+
+    // Halve the finer level, which is `buffer` if not null; returns a null level if `stale`
+    // returns true between tiles
+    static Level downsample(const ImageBuffer *buffer, const Level &finer, TileStore &store,
+                            const std::function<bool()> &stale);
+
+    const ImageBuffer *buffer = nullptr;
+    QCache<quint64, QImage> tileCache; // full resolution tiles, cost in KB
+    std::shared_ptr<TileStore> store;
+    std::vector<Level> levels; // levels[0] is unused
+    QSet<int> pendingLevels;
+    // Bumped whenever the buffer changes; workers of an older generation stop at the next tile
+    QAtomicInt generation;
+    QList<QFuture<void>> workers;
+};
+
+
+Q_DECLARE_METATYPE(TiledImageItem::Level)
+
+
+#endif //POISSONEDITOR_TILEDIMAGEITEM_H
@@ -0,0 +1,205 @@
+#include <climits>
+
+#include <QtConcurrent>
+
+#include "tilestore.h"
+
+struct TileStore::Tile {
+    QImage image; // null if paged out
+    QSize size;
+    QImage::Format format;
+    qint64 slot = -1; // position in the scratch file, -1 if never written
+    std::list<Tile *>::iterator lruPos;
+};
+
+static inline qint64 imageBytes(const QImage &image) {
+    return static_cast<qint64>(image.bytesPerLine()) * image.height();
+}
+
+TileStore::TileStore(qint64 memoryBudget)
+        : budget(memoryBudget), scratch(QDir(QDir::tempPath()).filePath("poisson-editor-tiles-XXXXXX")) {}
+
+std::shared_ptr<TileStore> TileStore::global() {
+    static std::shared_ptr<TileStore> store = [] {
+        QSettings settings(QCoreApplication::organizationName(), QCoreApplication::applicationName());
+        return std::make_shared<TileStore>(settings.value("tileStore/memoryBudgetMB", 2048).toLongLong() << 20);
+    }();
+    return store;
+}
+
+qint64 TileStore::memoryBudget() const {
+    return budget;
+}
+
+bool TileStore::shouldTile(const QSize &size, int depth) const {
+    // Leave room for the working copies made by editing operations
+    qint64 bytes = static_cast<qint64>(size.width()) * size.height() * depth / 8;
+    return bytes > budget / 2 || bytes > INT_MAX;
+}
+
+TileStore::TilePtr TileStore::create(const QImage &image) {
+    assert(image.width() <= tileSize && image.height() <= tileSize && image.depth() <= 32);
+    auto *tile = new Tile;
+    tile->image = image;
+    tile->size = image.size();
+    tile->format = image.format();
+    Spills spills;
+    {
+        QMutexLocker locker(&mutex);
+        lru.push_front(tile);
+        tile->lruPos = lru.begin();
+        memoryInUse += imageBytes(image);
+        evict(spills);
+    }
+    write(spills);
+    auto self = shared_from_this();
+    return TilePtr(tile, [self](Tile *tile) { self->release(tile); });
+}
+
+QImage TileStore::pixels(const TilePtr &tile) {
+    Spills spills;
+    QImage image;
+    {
+        QMutexLocker locker(&mutex);
+        makeResident(tile.get(), spills);
+        image = tile->image;
+    }
+    write(spills);
+    return image;
+}
+
+void TileStore::prefetch(const std::vector<TilePtr> &tiles) {
+    std::vector<TilePtr> missing;
+    {
+        QMutexLocker locker(&mutex);
+        for (const auto &tile : tiles)
+            if (tile->image.isNull()) missing.push_back(tile);
+    }
+    if (missing.empty()) return;
+    auto self = shared_from_this();
+    QtConcurrent::run([self, missing]() {
+        // Lock per tile, so that other threads are not blocked for the whole batch
+        for (const auto &tile : missing) {
+            Spills spills;
+            {
+                QMutexLocker locker(&self->mutex);
+                self->makeResident(tile.get(), spills);
+            }
+            self->write(spills);
+        }
+    });
+}
+
+void TileStore::release(Tile *tile) {
+    {
+        QMutexLocker locker(&mutex);
+        if (!tile->image.isNull()) {
+            lru.erase(tile->lruPos);
+            memoryInUse -= imageBytes(tile->image);
+        }
+        auto spill = spilling.find(tile->slot);
+        if (spill != spilling.end()) spill->second.tile = nullptr;
+        else if (tile->slot >= 0) freeSlots.push_back(tile->slot);
+    }
+    delete tile;
+}
+
+// Must be called with the mutex locked
+void TileStore::makeResident(Tile *tile, Spills &spills) {
+    if (!tile->image.isNull()) {
+        lru.splice(lru.begin(), lru, tile->lruPos); // mark as most recently used
+        return;
+    }
+    QImage image;
+    auto spill = spilling.find(tile->slot);
+    if (spill != spilling.end()) {
+        image = spill->second.image; // not written yet, the write goes on and is kept
+    } else {
+        image = QImage(tile->size, tile->format);
+        qint64 bytes = imageBytes(image);
+        if (!scratchReader.seek(tile->slot * slotBytes)
+            || scratchReader.read(reinterpret_cast<char *>(image.bits()), bytes) != bytes) {
+            qWarning() << "TileStore::makeResident : cannot read scratch file," << scratchReader.errorString();
+            image.fill(0);
+        }
+    }
+    tile->image = image;
+    lru.push_front(tile);
+    tile->lruPos = lru.begin();
+    memoryInUse += imageBytes(image);
+    evict(spills);
+}
+
+// Must be called with the mutex locked
+void TileStore::evict(Spills &spills) {
+    // The most recently used tile is always kept, as it is about to be accessed
+    while (memoryInUse > budget && lru.size() > 1) {
+        Tile *tile = lru.back();
+        // Tiles never change, so a tile already in the scratch file does not need to be written again
+        if (tile->slot < 0) {
+            if (!openScratch()) return;
+            qint64 slot;
+            if (!freeSlots.empty()) {
+                slot = freeSlots.back();
+                freeSlots.pop_back();
+            } else {
+                slot = slotCount++;
+            }
+            tile->slot = slot;
+            spilling[slot] = {tile, tile->image};
+            spills.emplace_back(slot, tile->image);
+        }
+        memoryInUse -= imageBytes(tile->image);
+        tile->image = QImage();
+        lru.pop_back();
+    }
+}
+
+// Must be called with the mutex locked
+bool TileStore::openScratch() {
+    if (scratchReader.isOpen()) return true;
+    if (!scratch.isOpen() && !scratch.open()) {
+        qWarning() << "TileStore::openScratch : cannot create scratch file," << scratch.errorString();
+        return false;
+    }
+    scratchReader.setFileName(scratch.fileName());
+    scratchWriter.setFileName(scratch.fileName());
+    if (!scratchWriter.open(QIODevice::ReadWrite | QIODevice::Unbuffered)
+        || !scratchReader.open(QIODevice::ReadOnly | QIODevice::Unbuffered)) {
+        qWarning() << "TileStore::openScratch : cannot open scratch file," << scratchWriter.errorString();
+        scratchWriter.close();
+        return false;
+    }
+    return true;
+}
+
+void TileStore::write(const Spills &spills) {
+    for (const auto &spill : spills) {
+        const qint64 slot = spill.first;
+        const QImage &image = spill.second;
+        const qint64 bytes = imageBytes(image);
+        bool written;
+        {
+            QMutexLocker locker(&writeMutex);
+            written = scratchWriter.seek(slot * slotBytes)
+                      && scratchWriter.write(reinterpret_cast<const char *>(image.constBits()), bytes) == bytes;
+        }
+        if (!written) qWarning() << "TileStore::write : cannot write scratch file," << scratchWriter.errorString();
+
+        QMutexLocker locker(&mutex);
+        auto pending = spilling.find(slot);
+        Tile *tile = pending->second.tile;
+        spilling.erase(pending);
+        if (tile != nullptr && !written) {
+            // Kept in memory as the least recently used tile instead, and written again when evicted
+            tile->slot = -1;
+            if (tile->image.isNull()) {
+                tile->image = image;
+                lru.push_back(tile);
+                tile->lruPos = std::prev(lru.end());
+                memoryInUse += bytes;
+            }
+        }
+        if (tile == nullptr || !written) freeSlots.push_back(slot);
+    }
+}
@@ -0,0 +1,79 @@
+#ifndef POISSONEDITOR_TILESTORE_H
+#define POISSONEDITOR_TILESTORE_H
+
+#include <list>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include <QtCore>
+#include <QImage>
+
+
+// Pager for image tiles that do not all fit into memory
+// Tiles are immutable once created, so they can be shared between copies of an image
+// buffer without locking the pixels. When resident tiles exceed the memory budget, the
+// least recently used ones are written to a scratch file and loaded back when accessed.
+// All methods are thread-safe. Tiles are picked for eviction with the store locked but written
+// after it is unlocked, so that threads fetching other tiles do not wait for the disk.
+class TileStore : public std::enable_shared_from_this<TileStore> {
+public:
+    static const int tileSize = 256;
+
+    struct Tile;
+    typedef std::shared_ptr<Tile> TilePtr;
+
+    explicit TileStore(qint64 memoryBudget);
+    TileStore(const TileStore &) = delete;
+    TileStore &operator =(const TileStore &) = delete;
+
+    // Store shared by all image buffers, with the memory budget read from settings
+    static std::shared_ptr<TileStore> global();
+
+    qint64 memoryBudget() const;
+    // Whether an image of this size should be kept in tiles instead of a single QImage, because
+    // it takes too much of the memory budget or is over the 2 GB that a QImage can hold
+    bool shouldTile(const QSize &size, int depth) const;
+
+    // The image must be at most tileSize x tileSize with at most 32 bits per pixel
+    TilePtr create(const QImage &image);
+    // Load the tile if it has been paged out
+    QImage pixels(const TilePtr &tile);
+    // Load the tiles on the global thread pool
+    void prefetch(const std::vector<TilePtr> &tiles);
+
+private:
+    // Tile taken out of memory whose pixels are being written to the scratch file
+    struct Spill {
+        Tile *tile; // null once the tile is released, its slot is then freed when written
+        QImage image;
+    };
+    typedef std::vector<std::pair<qint64, QImage>> Spills; // slots and pixels to write
+
+    void release(Tile *tile);
+    // Must be called with the mutex locked, tiles evicted meanwhile are added to `spills`
+    void makeResident(Tile *tile, Spills &spills);
+    void evict(Spills &spills);
+    bool openScratch();
+    // Must be called with the mutex unlocked
+    void write(const Spills &spills);
+
+    QMutex mutex;
+    qint64 budget;
+    qint64 memoryInUse = 0; // pixels still being written are not counted
+    std::list<Tile *> lru; // resident tiles, most recently used first
+    std::map<qint64, Spill> spilling; // by slot
+
+    // Reads are made with the mutex locked, writes with writeMutex only, each through a handle of
+    // its own; both are unbuffered, so that reads see what was written
+    QTemporaryFile scratch;
+    QFile scratchReader;
+    QMutex writeMutex;
+    QFile scratchWriter;
+    const qint64 slotBytes = static_cast<qint64>(tileSize) * tileSize * 4;
+    qint64 slotCount = 0;
+    std::vector<qint64> freeSlots;
+};
+
+
+#endif //POISSONEDITOR_TILESTORE_H
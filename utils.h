@@ -1,11 +1,16 @@
 #ifndef POISSONEDITOR_UTILS_H
 #define POISSONEDITOR_UTILS_H
 
+#include <algorithm>
 #include <cassert>
+#include <cstdlib>
+#include <utility>
+#include <vector>
 
 #include <qmath.h>
 #include <QRect>
 #include <QRectF>
+#include <QImage>
 
 
 class BitMatrix;
@@ -24,6 +29,22 @@ namespace utils {
         return alignedRect;
     }
 
+    // Copy `srcRect` of `src` into `dst` with its top-left corner at `pos`
+    // Both images must have the same format with whole bytes per pixel, and the rect must fit inside `dst`
+    inline void copyRect(QImage &dst, const QPoint &pos, const QImage &src, const QRect &srcRect) {
+        assert(dst.format() == src.format() && dst.depth() % 8 == 0);
+        assert(src.rect().contains(srcRect) && dst.rect().contains(QRect(pos, srcRect.size())));
+        int bytesPerPixel = dst.depth() / 8;
+        for (int y = 0; y < srcRect.height(); ++y)
+            memcpy(dst.scanLine(pos.y() + y) + pos.x() * bytesPerPixel,
+                   src.constScanLine(srcRect.y() + y) + srcRect.x() * bytesPerPixel,
+                   static_cast<size_t>(srcRect.width() * bytesPerPixel));
+    }
+
+    inline void copyRect(QImage &dst, const QPoint &pos, const QImage &src) {
+        copyRect(dst, pos, src, src.rect());
+    }
+
     template <typename T>
     class Matrix {
     protected:
@@ -59,6 +80,8 @@ namespace utils {
         }
 
         Matrix &operator =(const Matrix &mat) {
+            if (this == &mat) return *this;
+            delete[] arr;
             n = mat.n, m = mat.m;
             arr = new T[n * m];
             memcpy(arr, mat.arr, sizeof(T) * n * m);
@@ -66,6 +89,8 @@ namespace utils {
         }
 
         Matrix &operator =(Matrix &&mat) noexcept {
+            if (this == &mat) return *this;
+            delete[] arr;
             n = mat.n, m = mat.m;
             arr = mat.arr;
             mat.arr = nullptr;
@@ -95,6 +120,78 @@ namespace utils {
         }
     };
 
+
+    // Scratch memory for buffers needed on every iteration of an algorithm
+    // Buffers are carved out of 64-byte aligned blocks and all released at once by reset(), which
+    // keeps the blocks; once the blocks are large enough, iterations allocate nothing.
+    class Arena {
+        struct Block {
+            char *memory, *data;
+            size_t size;
+        };
+
+        std::vector<Block> blocks;
+        size_t current = 0, used = 0; // block being carved and bytes taken from it
+        size_t blockSize;
+        int allocationCount = 0;
+
+    public:
+        static const size_t alignment = 64;
+
+        explicit Arena(size_t blockSize = 1 << 16) : blockSize(blockSize) {}
+        Arena(const Arena &) = delete;
+        Arena &operator =(const Arena &) = delete;
+
+        Arena(Arena &&arena) noexcept
+                : blocks(std::move(arena.blocks)), current(arena.current), used(arena.used),
+                  blockSize(arena.blockSize), allocationCount(arena.allocationCount) {
+            arena.blocks.clear();
+        }
+
+        ~Arena() {
+            for (auto &block : blocks)
+                std::free(block.memory);
+        }
+
+        // Uninitialized space for `count` objects of a trivial type, valid until reset()
+        template <typename T>
+        T *allocate(size_t count) {
+            size_t bytes = (count * sizeof(T) + alignment - 1) / alignment * alignment;
+            while (current < blocks.size() && used + bytes > blocks[current].size)
+                ++current, used = 0;
+            if (current == blocks.size()) {
+                Block block;
+                block.size = std::max(bytes, blockSize);
+                block.memory = static_cast<char *>(std::malloc(block.size + alignment));
+                block.data = block.memory + (alignment - reinterpret_cast<size_t>(block.memory) % alignment);
+                blocks.push_back(block);
+                ++allocationCount;
+            }
+            T *result = reinterpret_cast<T *>(blocks[current].data + used);
+            used += bytes;
+            return result;
+        }
+
+        void reset() {
+            // Space spread over several blocks is joined into one, for the next iterations
+            if (current > 0) {
+                size_t total = 0;
+                for (auto &block : blocks) {
+                    total += block.size;
+                    std::free(block.memory);
+                }
+                blocks.clear();
+                blockSize = std::max(blockSize, total);
+            }
+            current = 0, used = 0;
+        }
+
+        // Blocks allocated from the heap so far
+        int allocations() const {
+            return allocationCount;
+        }
+    };
+
 }
 
 #endif //POISSONEDITOR_UTILS_H